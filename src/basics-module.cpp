@@ -0,0 +1,6 @@
+#include "runtime.h"
+#include "basics-module.h"
+#include "opcodes.h"
+ELIOT_BEGIN
+#include "basics.tbl"
+ELIOT_END
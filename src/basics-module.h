@@ -0,0 +1,9 @@
+#ifndef BASICS_MODULE_H
+#define BASICS_MODULE_H
+#define TBL_HEADER
+#include "opcodes.h"
+#include "basics.h"
+ELIOT_BEGIN
+#include "basics.tbl"
+ELIOT_END
+#endif // BASICS_MODULE_H
@@ -23,9 +23,12 @@
 #include "save.h"
 #include "errors.h"
 #include "basics.h"
+#include "memo.h"
 
 #include <algorithm>
 #include <sstream>
+#include <set>
+#include <sys/time.h>
 
 ELIOT_BEGIN
 
@@ -35,45 +38,259 @@ ELIOT_BEGIN
 //
 // ============================================================================
 
+static Tree *runThunk(Function *function, Scope *scope, Tree *what)
+// ----------------------------------------------------------------------------
+//   Run a function that takes no argument other than what it captured
+// ----------------------------------------------------------------------------
+{
+    Slots frame(function->captured.begin(), function->captured.end());
+    uint size = frame.size();
+    frame.push_back(what);
+    frame.push_back(scope);
+    Data data = &frame[size];
+    Op *op = function;
+    while(op)
+        op = op->Run(data);
+    return DataResult(data);
+}
+
+
 Tree *EvaluateWithBytecode(Context *ctx, Tree *what)
 // ----------------------------------------------------------------------------
 //   Compile bytecode and then evaluate it
 // ----------------------------------------------------------------------------
+//   Deferred arguments are forced here, and usually find their code
+//   already compiled as a thunk by the function that passed them.
 {
-    TreeIDs  noParms;
-    TreeList captured;
-
-    Function *function = CompileToBytecode(ctx, what, NULL, noParms, captured);
-    Tree_p result = what;
-    if (function)
+    Scope *scope = ctx->CurrentScope();
+    Function *function = Function::Cached(what, scope);
+    if (!function)
     {
-        ELIOT_ASSERT(function->Inputs() == 0);
-        uint size = captured.size();
-        Scope *scope = ctx->CurrentScope();
-        captured.push_back(what);
-        captured.push_back(scope);
-        Data data = &captured[size];
-        Op *op = function;
-        while(op)
-            op = op->Run(data);
-        result = DataResult(data);
+        TreeIDs  noParms;
+        TreeList captured;
+        function = CompileToBytecode(ctx, what, NULL, noParms, captured);
+        if (!function)
+            return what;
     }
-    return result;
+    ELIOT_ASSERT(function->Inputs() == 0);
+    return runThunk(function, scope, what);
 }
 
 
 Function *CompileToBytecode(Context *ctx, Tree *what, Tree *type,
-                            TreeIDs &parms, TreeList &captured)
+                            TreeIDs &parms, TreeList &captured, Scope *scope)
 // ----------------------------------------------------------------------------
 //    Compile a tree to bytecode
 // ----------------------------------------------------------------------------
 {
     CodeBuilder  builder(captured);
-    Function *function = builder.Compile(ctx, what, parms, type);
+    Function *function = builder.Compile(ctx, what, parms, type, scope);
     return function;
 }
 
 
+Tree *CallWithBytecode(Scope *declScope, Infix *decl, Tree *type,
+                       TreeList &names, TreeList &args)
+// ----------------------------------------------------------------------------
+//    Run the body of a rewrite as bytecode, given its bound arguments
+// ----------------------------------------------------------------------------
+//    This is used by the interpreter at -O2 for rewrites that are called
+//    often. The body is compiled for the declaration scope with the same
+//    parameter order as a CallOp would use, so the code is shared with
+//    calls from bytecode. Returns NULL if the body could not be compiled.
+{
+    Context_p argsCtx = new Context(declScope);
+    argsCtx->CreateScope();
+
+    Tree *body = decl->right;
+    if (Memo *memo = MemoInfo(decl))
+        body = memo->body;
+
+    TreeIDs parms;
+    uint    nargs = args.size();
+    for (uint a = 0; a < nargs; a++)
+    {
+        Rewrite *rw = argsCtx->Define(names[a], args[a]);
+        parms[rw->left] = ~a;
+    }
+
+    // Compilation errors only mean that we keep interpreting
+    TreeList  captured;
+    Function *function = NULL;
+    {
+        Errors errors;
+        function = CompileToBytecode(argsCtx, body, type,
+                                     parms, captured, declScope);
+        errors.Clear();
+    }
+    if (!function || captured.size())
+        return NULL;
+
+    // Inputs are at negative offsets, first argument at -1
+    Slots frame;
+    frame.reserve(nargs + 2);
+    for (uint a = nargs; a > 0; a--)
+        frame.push_back(args[a-1]);
+    frame.push_back(decl->right);
+    frame.push_back(declScope);
+    Data data = &frame[nargs];
+    Op *op = function;
+    while (op)
+        op = op->Run(data);
+
+    Tree *result = DataResult(data);
+    return result ? result : eliot_error;
+}
+
+
+
+// ============================================================================
+//
+//   Evaluation stack
+//
+// ============================================================================
+//
+//   Frames for functions are allocated from a contiguous stack, in segments
+//   sized from the -stack option. A frame never straddles two segments,
+//   so that pointers to existing frames remain valid when the stack grows.
+//   Free slots are always NULL, which is what EvalOp expects for locals.
+//   With -deferred, slots are not counted, and the frame stack is a root
+//   that the garbage collector counts before each collection.
+
+struct FrameStack : GarbageCollector::Roots
+// ----------------------------------------------------------------------------
+//   A growable stack of slots used to allocate function frames
+// ----------------------------------------------------------------------------
+{
+    FrameStack(): segments(), current(0), depth(0),
+                  tailCall(NULL), tailArgs() {}
+
+    Data Allocate(uint size)
+    {
+        if (segments.size() == 0)
+            Grow(size);
+        Segment *seg = &segments[current];
+        if (seg->used + size > seg->size)
+        {
+            // Move to the next segment, creating it if needed
+            current++;
+            if (current >= segments.size() || segments[current].size < size)
+                Grow(size);
+            seg = &segments[current];
+            ELIOT_ASSERT(seg->used == 0);
+        }
+        Data frame = seg->base + seg->used;
+        seg->used += size;
+        depth++;
+        return frame;
+    }
+
+    void Free(Data frame, uint size)
+    {
+        // Clear the slots to release references and keep them NULL
+        for (uint i = 0; i < size; i++)
+            frame[i] = NULL;
+
+        Segment *seg = &segments[current];
+        ELIOT_ASSERT(frame + size == seg->base + seg->used);
+        seg->used -= size;
+        if (seg->used == 0 && current > 0)
+            current--;
+        depth--;
+    }
+
+    void Grow(uint size)
+    {
+        // Each segment holds enough for 'stack_depth' small frames,
+        // since -stack is now only bounded by memory, cap the segment size
+        uint frames = MAIN->options.stack_depth;
+        if (frames > 1000000)
+            frames = 1000000;
+        uint segSize = frames * 16;
+        if (segSize < size)
+            segSize = size;
+        Segment seg = { new Slot[segSize], segSize, 0 };
+        if (current < segments.size())
+        {
+            // Existing segment too small for that frame: replace it
+            delete[] segments[current].base;
+            segments[current] = seg;
+        }
+        else
+        {
+            segments.push_back(seg);
+        }
+    }
+
+    virtual void Acquire()
+    {
+        for (uint s = 0; s < segments.size(); s++)
+            for (uint i = 0; i < segments[s].used; i++)
+                TypeAllocator::Acquire(segments[s].base[i].Pointer());
+        for (uint i = 0; i < tailArgs.size(); i++)
+            TypeAllocator::Acquire(tailArgs[i].Pointer());
+    }
+
+    virtual void Release()
+    {
+        for (uint s = 0; s < segments.size(); s++)
+            for (uint i = 0; i < segments[s].used; i++)
+                TypeAllocator::Release(segments[s].base[i].Pointer());
+        for (uint i = 0; i < tailArgs.size(); i++)
+            TypeAllocator::Release(tailArgs[i].Pointer());
+    }
+
+    struct Segment
+    {
+        Slot *          base;
+        uint            size;
+        uint            used;
+    };
+    std::vector<Segment> segments;
+    uint                 current;
+    uint                 depth;
+
+    // Pending tail call, with arguments laid out like in a frame
+    Function *           tailCall;
+    Slots                tailArgs;
+};
+
+static FrameStack *frameStack = NULL;
+
+
+
+struct ThreadedCode
+// ----------------------------------------------------------------------------
+//   A flat array of instructions lowered from a code sequence
+// ----------------------------------------------------------------------------
+{
+    enum opcode
+    {
+        GENERIC, CONST, SELF, VALUE, STORE, CLEAR, EVAL, WHEN,
+        MATCH_NAME, MATCH_INTEGER, MATCH_REAL, DISPATCH, CONST_STORE
+    };
+    enum { END = ~0U };
+
+    struct Instr
+    {
+        uint16          opcode;
+        int32           a, b;           // Operands, typically data IDs
+        uint32          next, fail;     // Exits as instruction indices
+        Op *            op;             // Original op
+    };
+    typedef std::vector<Instr>  Instrs;
+
+    ThreadedCode(Code *code);
+    void                Run(Data data, uint32 pc);
+    void                Dump(std::ostream &out);
+
+    Instrs              instrs;
+    std::vector<uint32> jumps;          // Dispatch targets
+    uint32              entry;
+    bool                valid;
+};
+
+
 
 // ============================================================================
 //
@@ -161,8 +378,12 @@ struct EvalOp : FailOp
 
         // Complete evaluation of the bytecode we were given
         Op *op = ops;
-        while (op)
-            op = op->Run(data);
+        if (Profiler *profiler = Profiler::profiler)
+            while (op)
+                op = profiler->Step(op, data);
+        else
+            while (op)
+                op = op->Run(data);
 
         // Save the result if evaluation was successful
         if (Tree *result = DataResult(data))
@@ -210,6 +431,8 @@ struct ArgEvalOp : FailOp
         Context *ctx = context;
         if (self->IsConstant())
             result = self;
+        else if (MAIN->options.optimize_level == 2)
+            result = ctx->Evaluate(self);   // Interpreted again at -O2
         else
             result = EvaluateWithBytecode(ctx, self);
         if (result)
@@ -232,6 +455,78 @@ struct ArgEvalOp : FailOp
 };
 
 
+struct GlobalOp : FailOp
+// ----------------------------------------------------------------------------
+//    Evaluate a global once, checking that it was not assigned since
+// ----------------------------------------------------------------------------
+//    The declaration is resolved when compiling, and 'ops' evaluate the
+//    value it had then. If an assignment replaced the value, evaluate the
+//    new one instead, so that assigning a global does not need to
+//    invalidate all the code compiled against its scope.
+{
+    GlobalOp(Scope *scope, Infix *decl, int id, Op *ops, Op *fail)
+        : FailOp(fail), scope(scope), decl(decl), value(decl->right),
+          ops(ops), id(id) {}
+    Scope_p   scope;
+    Infix_p   decl;
+    Tree_p    value;
+    Op       *ops;
+    int       id;
+
+    virtual Op *        Run(Data data)
+    {
+        Tree *result = data[id];
+        if (result)
+        {
+            DataResult(data, result);
+            return success;
+        }
+
+        Tree *current = decl->right;
+        if (current == value)
+        {
+            // Same version as when compiled, run the compiled code
+            Op *op = ops;
+            if (Profiler *profiler = Profiler::profiler)
+                while (op)
+                    op = profiler->Step(op, data);
+            else
+                while (op)
+                    op = op->Run(data);
+            result = DataResult(data);
+        }
+        else
+        {
+            // Assigned since, typically a constant
+            Context_p context = new Context(scope);
+            if (Tree *inside = IsClosure(current, &context))
+                current = inside;
+            if (current->IsConstant())
+                result = current;
+            else if (MAIN->options.optimize_level == 2)
+                result = context->Evaluate(current);
+            else
+                result = EvaluateWithBytecode(context, current);
+            DataResult(data, result);
+        }
+
+        if (result)
+        {
+            data[id] = result;
+            return success;
+        }
+        return fail;
+    }
+
+    virtual kstring     OpID()          { return "global"; }
+    virtual void        Dump(std::ostream &out)
+    {
+        out << OpID() << "\t" << id << "\t" << decl->left << "\t"
+            << Code::Ref(ops, "\t", "code", "null");
+    }
+};
+
+
 struct ClearOp : Op
 // ----------------------------------------------------------------------------
 //    Clear a range of eval entries after a complete evaluation
@@ -325,14 +620,28 @@ struct CallOp : Op
 // ----------------------------------------------------------------------------
 {
     CallOp(Code *target, uint outId, ParmOrder &parms)
-        : target(target), outId(outId), parms(parms) {}
+        : target(target), outId(outId), parms(parms), tail(false) {}
     Code  *     target;
     int         outId;
     ParmOrder   parms;
+    bool        tail;
 
     virtual Op *Run(Data data)
     {
         uint sz = parms.size();
+
+        // Tail call: let Function::Run reuse the current frame
+        if (tail && sz == target->Inputs())
+        {
+            Slots &args = frameStack->tailArgs;
+            args.resize(sz + 1);
+            Data out = &args[sz];
+            for (uint p = 0; p < sz; p++)
+                out[~(int) p] = data[parms[p]];
+            frameStack->tailCall = (Function *) target;
+            return NULL;
+        }
+
         Data out = data + outId;
 
         // Copy result and scope
@@ -343,7 +652,7 @@ struct CallOp : Op
         for (uint p = 0; p < sz; p++)
         {
             int parmId = parms[p];
-            out[~p] = data[parmId];
+            out[~(int) p] = data[parmId];
         }
         Op *remaining = target->Run(out);
         ELIOT_ASSERT(!remaining);
@@ -354,7 +663,7 @@ struct CallOp : Op
         return success;
     }
 
-    virtual kstring     OpID()  { return "call"; }
+    virtual kstring     OpID()  { return tail ? "tailcall" : "call"; }
     virtual void        Dump(std::ostream &out)
     {
         out << OpID() << "\t" << Code::Ref(target, "\t", "code", "null")
@@ -366,30 +675,84 @@ struct CallOp : Op
 };
 
 
+struct MemoCallOp : CallOp
+// ----------------------------------------------------------------------------
+//    Call a subroutine declared as 'memo', checking its cache first
+// ----------------------------------------------------------------------------
+//    The result must be recorded after the call, so it is never made a
+//    tail call. Calls with non-constant arguments are not cached.
+{
+    MemoCallOp(Code *target, uint outId, ParmOrder &parms, Memo *memo)
+        : CallOp(target, outId, parms), memo(memo) {}
+    Memo *      memo;
+
+    virtual Op *Run(Data data)
+    {
+        uint sz = parms.size();
+        TreeList args(sz);
+        for (uint p = 0; p < sz; p++)
+            args[p] = (Tree *) data[parms[p]];
+
+        bool memoize = Memo::Cacheable(args);
+        if (memoize)
+        {
+            if (Tree *cached = memo->Find(args))
+            {
+                DataResult(data, cached);
+                return success;
+            }
+        }
+
+        Op *remaining = CallOp::Run(data);
+        if (memoize && remaining == success)
+            memo->Enter(args, DataResult(data));
+        return remaining;
+    }
+
+    virtual kstring     OpID()  { return "memocall"; }
+};
+
+
 struct TypeCheckOp : FailOp
 // ----------------------------------------------------------------------------
 //   Check if a type matches the given type
 // ----------------------------------------------------------------------------
+//   Builtin types from the TYPE entries are checked directly by their
+//   opcode, which only tests the kind and applies conversions such as
+//   integer to real. Other types go through the general TypeCheck.
 {
-    TypeCheckOp(int value, int type, Op *fail)
-        : FailOp(fail), value(value), type(type) {}
+    TypeCheckOp(int value, int type, Op *fail, TypeCheckOpcode *builtin=NULL)
+        : FailOp(fail), value(value), type(type), builtin(builtin) {}
     int value;
     int type;
+    TypeCheckOpcode *builtin;
 
     virtual Op *        Run(Data data)
     {
-        Context_p context = new Context(DataScope(data));
-        Tree *cast = TypeCheck(context, data[type], data[value]);
+        Tree *cast = NULL;
+        if (builtin)
+        {
+            cast = builtin->Check(NULL, data[value]);
+        }
+        else
+        {
+            Context_p context = new Context(DataScope(data));
+            cast = TypeCheck(context, data[type], data[value]);
+        }
         if (!cast)
             return fail;
         DataResult(data, cast);
         return success;
     }
 
-    virtual kstring     OpID()  { return "typechk"; }
+    virtual kstring     OpID()  { return builtin ? "is" : "typechk"; }
     virtual void        Dump(std::ostream &out)
     {
-        out << OpID() << "\t" << value << ":" << type;
+        out << OpID() << "\t" << value << ":";
+        if (builtin)
+            out << builtin->OpID();
+        else
+            out << type;
     }
 };
 
@@ -416,7 +779,7 @@ struct IndexOp : FailOp
             if (inputs == 0)
             {
                 // If no arguments, evaluate as new callee
-                Tree_p args[2] = { data[0], data[1] };
+                Slot args[2] = { data[0], data[1] };
                 Op *remaining = code->Run(args);
                 ELIOT_ASSERT(!remaining);
                 if (remaining)
@@ -426,7 +789,7 @@ struct IndexOp : FailOp
             else if (inputs == 1)
             {
                 // Looks like a prefix, use it as an argument
-                Tree_p args[3] = { arg, data[0], data[1] };
+                Slot args[3] = { arg, data[0], data[1] };
                 Op *remaining = code->Run(&args[1]);
                 ELIOT_ASSERT(!remaining);
                 if (remaining)
@@ -458,7 +821,7 @@ struct IndexOp : FailOp
         if (Infix *lifx = callee->AsInfix())
         {
             // Check if we have a function definition
-            if (lifx->name == "->")
+            if (lifx->name == symArrow)
             {
                 // If we have a single name on the left, like (X->X+1)
                 // interpret that as a lambda function
@@ -529,6 +892,326 @@ struct PrefixFormErrorOp : FormErrorOp
 };
 
 
+struct DispatchOp : FailOp
+// ----------------------------------------------------------------------------
+//   Jump directly to the first candidate that may accept a value
+// ----------------------------------------------------------------------------
+//   Candidates for a form are tested one after the other. When they all
+//   begin by testing the same value, e.g. 'fib 0', 'fib 1', 'fib N:integer',
+//   we evaluate that value once, switch on its kind, then on its constant
+//   value or infix name, and skip candidates whose first test would fail.
+{
+    enum { ANY = ~0U, KINDS = INFIX + 1 };
+
+    DispatchOp(FailOp *lead, int id)
+        : FailOp(lead->fail), lead(lead), id(id), targets()
+    {
+        for (uint k = 0; k < KINDS; k++)
+            first[k] = ANY;
+    }
+    FailOp *                    lead;   // Evaluates the value we test
+    int                         id;     // Where that value is stored
+    Ops                         targets;// Candidate entries, then none
+    uint                        first[KINDS];
+    std::map<longlong, uint>    integers;
+    std::map<text, uint>        texts;
+    std::map<text, uint>        infixes;
+
+    void                AddCandidate(Op *start, uint kinds, Tree *value)
+    {
+        uint pos = targets.size();
+        targets.push_back(start);
+        for (uint k = 0; k < KINDS; k++)
+        {
+            if (!(kinds & (1U << k)))
+                continue;
+            if (Integer *ival = value ? value->AsInteger() : NULL)
+                integers.insert(std::make_pair(ival->value, pos));
+            else if (Text *tval = value ? value->AsText() : NULL)
+                texts.insert(std::make_pair(tval->value, pos));
+            else if (Infix *ifx = value ? value->AsInfix() : NULL)
+                infixes.insert(std::make_pair(ifx->name, pos));
+            else if (first[k] == ANY)
+                first[k] = pos;
+        }
+    }
+
+    int                 Select(Data data)
+    {
+        if (lead->Run(data) != lead->success)
+            return -1;
+
+        // Closures and failed evaluations go through all candidates
+        Tree *value = data[id];
+        if (!value || IsClosure(value, NULL))
+            return 0;
+
+        kind k = value->Kind();
+        uint pos = first[k];
+        if (k == INTEGER)
+            pos = Lookup(integers, ((Integer *) value)->value, pos);
+        else if (k == TEXT)
+            pos = Lookup(texts, ((Text *) value)->value, pos);
+        else if (k == INFIX)
+            pos = Lookup(infixes, ((Infix *) value)->name.Value(), pos);
+        if (pos == ANY)
+            pos = targets.size() - 1;
+        return pos;
+    }
+
+    template <typename Key>
+    static uint         Lookup(std::map<Key, uint> &map, Key key, uint pos)
+    {
+        typename std::map<Key, uint>::iterator found = map.find(key);
+        if (found != map.end() && (*found).second < pos)
+            pos = (*found).second;
+        return pos;
+    }
+
+    static uint         Kinds(Tree *type)
+    {
+        // Value kinds accepted by builtin types, see basics.tbl
+        if (type == integer_type    || type == integer8_type   ||
+            type == integer16_type  || type == integer32_type  ||
+            type == integer64_type  || type == unsigned_type   ||
+            type == unsigned8_type  || type == unsigned16_type ||
+            type == unsigned32_type || type == unsigned64_type)
+            return 1U << INTEGER;
+        if (type == real_type)
+            return (1U << INTEGER) | (1U << REAL);
+        if (type == real32_type || type == real64_type)
+            return 1U << REAL;
+        if (type == text_type || type == character_type)
+            return 1U << TEXT;
+        if (type == boolean_type || type == symbol_type ||
+            type == name_type || type == operator_type)
+            return 1U << NAME;
+        if (type == infix_type || type == declaration_type)
+            return 1U << INFIX;
+        if (type == prefix_type)
+            return 1U << PREFIX;
+        if (type == postfix_type)
+            return 1U << POSTFIX;
+        if (type == block_type)
+            return 1U << BLOCK;
+        return ANY;
+    }
+
+    virtual Op *        Run(Data data)
+    {
+        int pos = Select(data);
+        return pos < 0 ? fail : targets[pos];
+    }
+
+    virtual kstring     OpID()  { return "dispatch"; }
+    virtual void        Dump(std::ostream &out)
+    {
+        out << OpID() << "\t" << id;
+        uint max = targets.size();
+        for (uint t = 0; t < max; t++)
+            out << Code::Ref(targets[t], "\n\t", "case", "return");
+    }
+};
+
+
+struct NumericOp : FailOp
+// ----------------------------------------------------------------------------
+//   Evaluate integer and real arithmetic in unboxed registers
+// ----------------------------------------------------------------------------
+//   Arithmetic on typed parameters and constants is compiled to a short
+//   register program when the type annotations tell which builtin opcodes
+//   the generic code would select. Intermediate results stay machine
+//   integers and doubles, only the final result is boxed. If an input is
+//   not of the expected kind, or a division by zero must be reported,
+//   the fail exit runs the generic code instead.
+{
+    enum code
+    {
+        LOAD_INT, LOAD_REAL, CONST_INT, CONST_REAL, INT_TO_REAL,
+        ADD, SUB, MUL, SDIV, SREM, AND, OR, XOR, SHL, ASHR, LSHR, NEG, NOT,
+        FADD, FSUB, FMUL, FDIV, FNEG,
+        ICMP_EQ, ICMP_NE, ICMP_SGT, ICMP_SGE, ICMP_SLT, ICMP_SLE,
+        FCMP_OEQ, FCMP_ONE, FCMP_OGT, FCMP_OGE, FCMP_OLT, FCMP_OLE
+    };
+    enum { MAX_INSTRS = 32 };
+    union Register
+    {
+        longlong        i;
+        double          r;
+    };
+    struct Instr
+    {
+        uint16          opcode;
+        uint16          left, right;    // Registers, i.e. instruction index
+        int             id;             // Data slot for loads
+        Register        value;          // Value for constants
+    };
+    typedef std::vector<Instr> Instrs;
+
+    struct Builtin
+    {
+        kstring         name;           // Name of the opcode in builtins
+        code            opcode;         // Register operation
+        kind            args, result;   // INTEGER, REAL or NAME (boolean)
+    };
+
+    NumericOp(TreePosition pos): FailOp(NULL), instrs(), result(INTEGER),
+                                 position(pos) {}
+    Instrs              instrs;
+    kind                result;
+    TreePosition        position;
+
+    uint                Emit(uint16 opcode, uint left = 0, uint right = 0,
+                             int id = 0)
+    {
+        Instr ins;
+        ins.opcode = opcode;
+        ins.left = left;
+        ins.right = right;
+        ins.id = id;
+        ins.value.i = 0;
+        instrs.push_back(ins);
+        return instrs.size() - 1;
+    }
+
+    static Builtin *    Find(kstring name)
+    {
+        static Builtin builtins[] =
+        {
+            { "Add",     ADD,      INTEGER, INTEGER },
+            { "Sub",     SUB,      INTEGER, INTEGER },
+            { "Mul",     MUL,      INTEGER, INTEGER },
+            { "SDiv",    SDIV,     INTEGER, INTEGER },
+            { "SRem",    SREM,     INTEGER, INTEGER },
+            { "And",     AND,      INTEGER, INTEGER },
+            { "Or",      OR,       INTEGER, INTEGER },
+            { "Xor",     XOR,      INTEGER, INTEGER },
+            { "Shl",     SHL,      INTEGER, INTEGER },
+            { "AShr",    ASHR,     INTEGER, INTEGER },
+            { "LShr",    LSHR,     INTEGER, INTEGER },
+            { "Neg",     NEG,      INTEGER, INTEGER },
+            { "Not",     NOT,      INTEGER, INTEGER },
+            { "FAdd",    FADD,     REAL,    REAL    },
+            { "FSub",    FSUB,     REAL,    REAL    },
+            { "FMul",    FMUL,     REAL,    REAL    },
+            { "FDiv",    FDIV,     REAL,    REAL    },
+            { "FNeg",    FNEG,     REAL,    REAL    },
+            { "ICmpEQ",  ICMP_EQ,  INTEGER, NAME    },
+            { "ICmpNE",  ICMP_NE,  INTEGER, NAME    },
+            { "ICmpSGT", ICMP_SGT, INTEGER, NAME    },
+            { "ICmpSGE", ICMP_SGE, INTEGER, NAME    },
+            { "ICmpSLT", ICMP_SLT, INTEGER, NAME    },
+            { "ICmpSLE", ICMP_SLE, INTEGER, NAME    },
+            { "FCmpOEQ", FCMP_OEQ, REAL,    NAME    },
+            { "FCmpONE", FCMP_ONE, REAL,    NAME    },
+            { "FCmpOGT", FCMP_OGT, REAL,    NAME    },
+            { "FCmpOGE", FCMP_OGE, REAL,    NAME    },
+            { "FCmpOLT", FCMP_OLT, REAL,    NAME    },
+            { "FCmpOLE", FCMP_OLE, REAL,    NAME    }
+        };
+        uint max = sizeof(builtins) / sizeof(builtins[0]);
+        for (uint b = 0; b < max; b++)
+            if (strcmp(builtins[b].name, name) == 0)
+                return &builtins[b];
+        return NULL;
+    }
+
+    virtual Op *        Run(Data data)
+    {
+        Register regs[MAX_INSTRS];
+        uint max = instrs.size();
+        for (uint i = 0; i < max; i++)
+        {
+            Instr    &ins = instrs[i];
+            Register &out = regs[i];
+            Register &l = regs[ins.left];
+            Register &r = regs[ins.right];
+            switch(ins.opcode)
+            {
+            case LOAD_INT:
+            {
+                Integer *ival = data[ins.id]->As<Integer>();
+                if (!ival)
+                    return fail;
+                out.i = ival->value;
+                break;
+            }
+            case LOAD_REAL:
+            {
+                Real *rval = data[ins.id]->As<Real>();
+                if (!rval)
+                    return fail;
+                out.r = rval->value;
+                break;
+            }
+            case CONST_INT:
+            case CONST_REAL:    out = ins.value;                        break;
+            case INT_TO_REAL:   out.r = l.i;                            break;
+
+            case ADD:           out.i = l.i + r.i;                      break;
+            case SUB:           out.i = l.i - r.i;                      break;
+            case MUL:           out.i = l.i * r.i;                      break;
+            case SDIV:          if (!r.i) return fail; out.i = l.i / r.i; break;
+            case SREM:          if (!r.i) return fail; out.i = l.i % r.i; break;
+            case AND:           out.i = l.i & r.i;                      break;
+            case OR:            out.i = l.i | r.i;                      break;
+            case XOR:           out.i = l.i ^ r.i;                      break;
+            case SHL:           out.i = l.i << r.i;                     break;
+            case ASHR:          out.i = l.i >> r.i;                     break;
+            case LSHR:          out.i = (ulonglong) l.i >> r.i;         break;
+            case NEG:           out.i = -l.i;                           break;
+            case NOT:           out.i = ~l.i;                           break;
+
+            case FADD:          out.r = l.r + r.r;                      break;
+            case FSUB:          out.r = l.r - r.r;                      break;
+            case FMUL:          out.r = l.r * r.r;                      break;
+            case FDIV:          if (!r.r) return fail; out.r = l.r / r.r; break;
+            case FNEG:          out.r = -l.r;                           break;
+
+            case ICMP_EQ:       out.i = l.i == r.i;                     break;
+            case ICMP_NE:       out.i = l.i != r.i;                     break;
+            case ICMP_SGT:      out.i = l.i >  r.i;                     break;
+            case ICMP_SGE:      out.i = l.i >= r.i;                     break;
+            case ICMP_SLT:      out.i = l.i <  r.i;                     break;
+            case ICMP_SLE:      out.i = l.i <= r.i;                     break;
+            case FCMP_OEQ:      out.i = l.r == r.r;                     break;
+            case FCMP_ONE:      out.i = l.r != r.r;                     break;
+            case FCMP_OGT:      out.i = l.r >  r.r;                     break;
+            case FCMP_OGE:      out.i = l.r >= r.r;                     break;
+            case FCMP_OLT:      out.i = l.r <  r.r;                     break;
+            case FCMP_OLE:      out.i = l.r <= r.r;                     break;
+            }
+        }
+
+        // Box the final result, the only value that escapes
+        Register &last = regs[max - 1];
+        if (result == INTEGER)
+            DataResult(data, new Integer(last.i, position));
+        else if (result == REAL)
+            DataResult(data, new Real(last.r, position));
+        else
+            DataResult(data, last.i ? eliot_true : eliot_false);
+        return success;
+    }
+
+    Tree_p              Fold()
+    {
+        for (uint i = 0; i < instrs.size(); i++)
+            if (instrs[i].opcode == LOAD_INT || instrs[i].opcode == LOAD_REAL)
+                return NULL;
+        Slot data[2];
+        Run(data);
+        return DataResult(data);
+    }
+
+    virtual kstring     OpID()  { return "numeric"; }
+    virtual void        Dump(std::ostream &out)
+    {
+        out << OpID() << "\t" << instrs.size() << " instrs";
+    }
+};
+
+
 
 // ============================================================================
 //
@@ -540,7 +1223,7 @@ Code::Code(Context *ctx, Tree *self)
 // ----------------------------------------------------------------------------
 //    Create a new code from the given ops
 // ----------------------------------------------------------------------------
-    : context(ctx), self(self), ops(NULL), instrs()
+    : context(ctx), self(self), ops(NULL), instrs(), threaded(NULL)
 {}
 
 
@@ -548,7 +1231,7 @@ Code::Code(Context *context, Tree *self, Op *ops)
 // ----------------------------------------------------------------------------
 //    Create a new code from the given ops
 // ----------------------------------------------------------------------------
-    : context(context), self(self), ops(ops), instrs()
+    : context(context), self(self), ops(ops), instrs(), threaded(NULL)
 {
     for (Op *op = ops; op; op = op->success)
         instrs.push_back(op);
@@ -560,9 +1243,12 @@ Code::~Code()
 //    Delete the ops we own
 // ----------------------------------------------------------------------------
 {
+    if (Profiler::profiler)
+        Profiler::profiler->Retire(this);
     for (Ops::iterator o = instrs.begin(); o != instrs.end(); o++)
         delete *o;
     instrs.clear();
+    delete threaded;
 }
 
 
@@ -592,6 +1278,10 @@ void Code::SetOps(Op **newOps, Ops *instrsToTakeOver, uint outId)
         if (FailOp *fop = dynamic_cast<FailOp *>(op))
             while (LabelOp *label = dynamic_cast<LabelOp *>(fop->fail))
                 fop->fail = label->success;
+        if (DispatchOp *dop = dynamic_cast<DispatchOp *>(op))
+            for (uint t = 0; t < dop->targets.size(); t++)
+                while (LabelOp *label=dynamic_cast<LabelOp*>(dop->targets[t]))
+                    dop->targets[t] = label->success;
     }
     for (uint i = 0; i < max; i++)
     {
@@ -604,6 +1294,43 @@ void Code::SetOps(Op **newOps, Ops *instrsToTakeOver, uint outId)
             delete label;
         }
     }
+
+    // Fuse frequent sequences into superinstructions
+    Peephole(&ops, instrs);
+    max = instrs.size();
+
+    // Identify tail calls, i.e. calls in the main sequence that are only
+    // followed by clearing locals. Sub-sequences run by EvalOp also end
+    // with NULL, but are not reachable through success or fail exits.
+    std::set<Op *> main;
+    Ops            pending;
+    if (ops)
+        pending.push_back(ops);
+    while (pending.size())
+    {
+        Op *op = pending.back();
+        pending.pop_back();
+        if (!op || main.count(op))
+            continue;
+        main.insert(op);
+        pending.push_back(op->success);
+        pending.push_back(op->Fail());
+        if (DispatchOp *dop = dynamic_cast<DispatchOp *>(op))
+            pending.insert(pending.end(),
+                           dop->targets.begin(), dop->targets.end());
+    }
+    for (uint i = 0; i < max; i++)
+    {
+        CallOp *call = dynamic_cast<CallOp *>(instrs[i]);
+        if (!call || !main.count(call) || !dynamic_cast<Function *>(call->target))
+            continue;
+        if (dynamic_cast<MemoCallOp *>(call))
+            continue;
+        Op *next = call->success;
+        while (next && dynamic_cast<ClearOp *>(next))
+            next = next->success;
+        call->tail = next == NULL;
+    }
 }
 
 
@@ -618,9 +1345,7 @@ Op *Code::Run(Data data)
     data[1] = scope;
 
     // Run all instructions we have in that code
-    Op *op = ops;
-    while (op)
-        op = op->Run(data);
+    Execute(data);
 
     // We were successful
     return success;
@@ -642,6 +1367,7 @@ void Code::Dump(std::ostream &out)
 
 
 static Ops *currentDump = NULL;
+static Profiler *currentProfile = NULL;
 
 void Code::Dump(std::ostream &out, Op *ops, Ops &instrs)
 // ----------------------------------------------------------------------------
@@ -655,6 +1381,8 @@ void Code::Dump(std::ostream &out, Op *ops, Ops &instrs)
     {
         Op *op = instrs[i];
         Op *fail = op->Fail();
+        if (currentProfile)
+            currentProfile->Annotate(out, op);
         if (op == ops)
             out << i << "=>\t" << op;
         else
@@ -683,10 +1411,18 @@ text Code::Ref(Op *op, text sep, text set, text null)
     uint max = currentDump ? currentDump->size() : 0;
 
     if (op == NULL)
-        found = (out << sep << null);
+    {
+        out << sep << null;
+        found = true;
+    }
     for (uint o = 0; o < max; o++)
+    {
         if ((*currentDump)[o] == op)
-            found = (out << sep << set << "\t#" << o);
+        {
+            out << sep << set << "\t#" << o;
+            found = true;
+        }
+    }
     if (!found)
         out << sep << set << "\t" << (void *) op;
     return out.str();
@@ -697,7 +1433,8 @@ Function::Function(Context *context, Tree *self, uint nInputs, uint nLocals)
 // ----------------------------------------------------------------------------
 //   Create a function
 // ----------------------------------------------------------------------------
-    : Code(context, self), nInputs(nInputs), nLocals(nLocals)
+    : Code(context, self), nInputs(nInputs), nLocals(nLocals),
+      captured(), scope(NULL), epoch(0)
 {}
 
 
@@ -707,7 +1444,7 @@ Function::Function(Function *original, Data data, ParmOrder &capture)
 // ----------------------------------------------------------------------------
     : Code(original->context, original->self),
       nInputs(original->nInputs), nLocals(original->nLocals),
-      captured()
+      captured(), scope(NULL), epoch(0)
 {
     // We have no instrs, so we don't "own" the instructions
     ops = original->ops;
@@ -728,63 +1465,165 @@ Function::~Function()
 // ----------------------------------------------------------------------------
 //    Destructor for functions
 // ----------------------------------------------------------------------------
-{}
+{
+    if (Profiler::profiler)
+        Profiler::profiler->Retire(this);
+}
 
 
 Op *Function::Run(Data data)
 // ----------------------------------------------------------------------------
 //   Create a new scope and run all instructions in the sequence
 // ----------------------------------------------------------------------------
+//   Tail calls are run in a loop, replacing the current frame with the frame
+//   of the called function, so that 'loop Body' runs in constant stack.
 {
-    Scope *scope     = context->CurrentScope();
-    uint   frameSize = FrameSize();
-    uint   offset    = OffsetSize();
-    Data   frame     = new Tree_p[frameSize];
-    Data   newData   = frame + offset;
+    // Check that we don't recurse too deep
+    if (!frameStack)
+    {
+        frameStack = new FrameStack;
+        if (TypeAllocator::deferred)
+            GarbageCollector::AddRoots(frameStack);
+    }
+    if (frameStack->depth >= MAIN->options.stack_depth)
+    {
+        Ooops("Stack depth exceeded evaluating $1", self);
+        DataResult(data, eliot_error);
+        return success;
+    }
 
-    // Initialize self and scope
-    newData[0] = self;
-    newData[1] = scope;
+    Function *fn   = this;
+    Data      args = data;
+    while (true)
+    {
+        Scope *scope     = fn->context->CurrentScope();
+        uint   frameSize = fn->FrameSize();
+        uint   offset    = fn->OffsetSize();
+        Data   frame     = frameStack->Allocate(frameSize);
+        Data   newData   = frame + offset;
+
+        // Initialize self and scope
+        newData[0] = fn->self;
+        newData[1] = scope;
+
+        // Copy input arguments
+        uint inputs   = fn->Inputs();
+        Data oarg = &newData[-1];
+        Data iarg = &args[-1];
+        for (uint a = 0; a < inputs; a++)
+            *oarg-- = *iarg--;
+        if (args != data)
+            frameStack->tailArgs.clear();
+
+        // Copy closure data if any
+        uint closures = fn->Closures();
+        if (closures)
+        {
+            Tree_p *carg = fn->ClosureData();
+            for (uint c = 0; c < closures; c++)
+                *oarg-- = *carg++;
+        }
 
-    // Copy input arguments
-    uint inputs   = Inputs();
-    Data oarg = &newData[-1];
-    Data iarg = &data[-1];
-    for (uint a = 0; a < inputs; a++)
-        *oarg-- = *iarg--;
+        // Execute the following instructions in the newly created data context
+        fn->Execute(newData);
 
-    // Copy closure data if any
-    uint closures = Closures();
-    if (closures)
-    {
-        Data carg = ClosureData();
-        for (uint c = 0; c < closures; c++)
-            *oarg-- = *carg++;
-    }
+        // Check if we ended with a tail call
+        Function *next = frameStack->tailCall;
+        if (!next)
+        {
+            // Copy result and current context to the old data
+            Tree *result = DataResult(newData);
+            DataResult(data, result);
 
-    // Execute the following instructions in the newly created data context
-    Op *op = ops;
-    while (op)
-        op = op->Run(newData);
+            // Pop the frame, we no longer need it
+            frameStack->Free(frame, frameSize);
+            break;
+        }
 
-    // Copy result and current context to the old data
-    Tree *result = DataResult(newData);
-    DataResult(data, result);
+        // Replace the current frame with that of the tail call
+        frameStack->tailCall = NULL;
+        frameStack->Free(frame, frameSize);
+        fn = next;
+        args = &frameStack->tailArgs[next->Inputs()];
 
-    // Destroy the frame, we no longer need it
-    delete[] frame;
+        // Long-running loops must let the garbage collector run
+        GarbageCollector::SafePoint();
+    }
 
     // Evaluate next instruction
     return success;
 }
 
 
-void Function::Dump(std::ostream &out)
+ulong Function::currentEpoch = 0;
+
+
+Function *Function::Cached(Tree *what, Scope *scope)
 // ----------------------------------------------------------------------------
-//   Dump all the instructions
+//   Find the code compiled for a tree in the given scope, if still valid
 // ----------------------------------------------------------------------------
 {
-    out << OpID() << "\t" << (void *) (Op *) this
+    for (Info *i = what->info; i; i = i->next)
+        if (Function *function = dynamic_cast<Function *>(i))
+            if (function->scope == scope && function->epoch == currentEpoch)
+                return function;
+    return NULL;
+}
+
+
+void Function::Cache(Scope *defScope)
+// ----------------------------------------------------------------------------
+//   Record the scope the code depends on, and mark it and its parents
+// ----------------------------------------------------------------------------
+{
+    scope = defScope;
+    epoch = currentEpoch;
+    for (Scope *s = defScope; s; s = ScopeParent(s))
+    {
+        if (s->GetInfo<CompiledScopeInfo>())
+            break;
+        s->SetInfo<CompiledScopeInfo>(new CompiledScopeInfo);
+    }
+}
+
+
+void Function::ScopeChanged(Scope *scope)
+// ----------------------------------------------------------------------------
+//   Invalidate cached code if some was compiled against that scope
+// ----------------------------------------------------------------------------
+//   Stale functions are not deleted, since they may be running or be
+//   referenced by other code. They simply no longer match in Cached().
+{
+    if (scope->GetInfo<CompiledScopeInfo>())
+    {
+        currentEpoch++;
+        IFTRACE(compile)
+            std::cerr << "INVALIDATE scope " << (void *) scope
+                      << " epoch " << currentEpoch << "\n";
+    }
+}
+
+
+void Function::ValueChanged(Scope *scope, Infix *decl, Tree *old)
+// ----------------------------------------------------------------------------
+//   Invalidate cached code that may depend on the old value of a variable
+// ----------------------------------------------------------------------------
+//   Global variables are read through a GlobalOp, which notices that the
+//   value changed. Other values may have been compiled into the code.
+{
+    if (old->IsConstant() && RewriteDefined(decl->left)->AsName() &&
+        !decl->GetInfo<InlinedValueInfo>())
+        return;
+    ScopeChanged(scope);
+}
+
+
+void Function::Dump(std::ostream &out)
+// ----------------------------------------------------------------------------
+//   Dump all the instructions
+// ----------------------------------------------------------------------------
+{
+    out << OpID() << "\t" << (void *) (Op *) this
         << "\tentry\t" << (void *) ops
         << "\t" << self << "\n";
     out << "\talloc"
@@ -906,8 +1745,332 @@ void CodeBuilder::AddTypeCheck(Context *context, Tree *what, Tree *type)
 
     // Otherwise, we need to generate a dynamic match
     int valueID = ValueID(what);
-    int typeID = Evaluate(context, type);
-    Add(new TypeCheckOp(valueID, typeID, failOp));
+    Op *check = NULL;
+    if (TypeCheckOpcode *builtin = type->GetInfo<TypeCheckOpcode>())
+        check = new TypeCheckOp(valueID, 0, failOp, builtin);
+    else
+        check = new TypeCheckOp(valueID, Evaluate(context, type), failOp);
+    Add(check);
+    Guard(check, valueID, DispatchOp::Kinds(type));
+}
+
+
+void CodeBuilder::Guard(Op *guard, int id, uint kinds, Tree *value)
+// ----------------------------------------------------------------------------
+//   Record the first test of the current candidate for dispatch
+// ----------------------------------------------------------------------------
+//   The guard is only useful if nothing but the evaluation of the tested
+//   value runs before it, since dispatch may skip the candidate entirely.
+{
+    if (!dispatch.size())
+        return;
+    Candidate &candidate = dispatch.back();
+    if (candidate.guarded)
+        return;
+    candidate.guarded = true;
+
+    // Tests on the result need an EvalOp, type checks read the value
+    bool direct = dynamic_cast<TypeCheckOp *>(guard) != NULL;
+    bool evaluated = false;
+    for (Op *op = *candidate.slot; op != guard; op = op->success)
+    {
+        EvalOp *eval = dynamic_cast<EvalOp *>(op);
+        ArgEvalOp *arg = direct ? dynamic_cast<ArgEvalOp *>(op) : NULL;
+        if (!(eval && eval->id == id) && !(arg && arg->id == id))
+            return;
+        evaluated = true;
+    }
+    if (!evaluated)
+        return;
+
+    candidate.id = id;
+    candidate.kinds = kinds;
+    candidate.value = value;
+}
+
+
+void CodeBuilder::Dispatch(Op *none)
+// ----------------------------------------------------------------------------
+//   Insert a dispatch op in front of candidates testing the same value
+// ----------------------------------------------------------------------------
+{
+    uint max = dispatch.size();
+    if (max < 2)
+        return;
+    Candidate &first = dispatch[0];
+    if (first.id < 0 || (first.kinds == (uint) DispatchOp::ANY && !first.value))
+        return;
+
+    Op **slot = first.slot;
+    FailOp *lead = (FailOp *) *slot;
+    DispatchOp *dop = new DispatchOp(lead, first.id);
+    for (uint c = 0; c < max; c++)
+    {
+        Candidate &candidate = dispatch[c];
+        if (candidate.id == first.id)
+            dop->AddCandidate(*candidate.slot,
+                              candidate.kinds, candidate.value);
+        else
+            dop->AddCandidate(*candidate.slot, DispatchOp::ANY, NULL);
+    }
+    dop->targets.push_back(none);
+
+    IFTRACE(compile)
+        std::cerr << "DISPATCH " << max << " candidates on "
+                  << first.id << "\n";
+
+    // The lead evaluation stays in place as the entry of the first candidate
+    dop->success = lead;
+    *slot = dop;
+    instrs.push_back(dop);
+}
+
+
+struct NumericLookup
+// ----------------------------------------------------------------------------
+//   State while looking for the builtin an arithmetic form would select
+// ----------------------------------------------------------------------------
+{
+    NumericLookup(Context *context, Tree *form, kind left, kind right)
+        : context(context), form(form), left(left), right(right),
+          builtin(NULL), failed(false) {}
+    Context *           context;
+    Tree *              form;
+    kind                left, right;
+    NumericOp::Builtin *builtin;
+    bool                failed;
+};
+
+
+static int numericMatch(Context *context, Tree *pattern, kind k)
+// ----------------------------------------------------------------------------
+//   Check if a parameter pattern matches a value: 1 always, 0 never, -1 maybe
+// ----------------------------------------------------------------------------
+{
+    Infix *typed = pattern->AsInfix();
+    if (!typed || typed->name != symColon || !typed->left->AsName())
+        return -1;
+    Tree *type = typed->right;
+    if (Name *name = type->AsName())
+        if (Tree *original = context->Bound(name))
+            type = original;
+    if (type == integer_type)
+        return k == INTEGER ? 1 : 0;
+    if (type == real_type)
+        return k == INTEGER || k == REAL ? 1 : 0;
+    if (DispatchOp::Kinds(type) & (1U << k))
+        return -1;
+    return 0;
+}
+
+
+static Tree *numericLookup(Scope *evalScope, Scope *declScope,
+                           Tree *self, Infix *decl, void *cb)
+// ----------------------------------------------------------------------------
+//   Mirror the candidate selection of compileLookup for typed arithmetic
+// ----------------------------------------------------------------------------
+//   We stop at the first candidate that would always match, and give up
+//   on any candidate whose outcome can't be decided statically.
+{
+    NumericLookup *lookup = (NumericLookup *) cb;
+    Context       *context = lookup->context;
+    Tree          *form = lookup->form;
+
+    Tree *pattern = decl->left;
+    if (Infix *typeDecl = pattern->AsInfix())
+        if (typeDecl->name == symAs)
+            pattern = typeDecl->left;
+    if (Block *block = pattern->AsBlock())
+        pattern = block->child;
+    if (pattern->IsLeaf())
+        return NULL;
+
+    // Check the shape of the pattern and the types of the parameters
+    int matches = -1;
+    if (Infix *ifx = pattern->AsInfix())
+    {
+        Infix *fifx = form->AsInfix();
+        if (fifx && ifx->name == fifx->name)
+        {
+            int l = numericMatch(context, ifx->left, lookup->left);
+            int r = numericMatch(context, ifx->right, lookup->right);
+            matches = (l == 0 || r == 0) ? 0 : (l < 0 || r < 0) ? -1 : 1;
+        }
+    }
+    else if (Prefix *pfx = pattern->AsPrefix())
+    {
+        Prefix *fpfx = form->AsPrefix();
+        if (fpfx && Tree::Equal(pfx->left, fpfx->left))
+            matches = numericMatch(context, pfx->right, lookup->left);
+    }
+    if (matches == 0)
+        return NULL;
+    if (matches < 0)
+    {
+        lookup->failed = true;
+        return decl;
+    }
+
+    // The candidate is selected: it must be one of the builtins we know
+    Opcode *opcode = OpcodeInfo(decl);
+    lookup->builtin = opcode ? NumericOp::Find(opcode->OpID()) : NULL;
+    if (!lookup->builtin)
+        lookup->failed = true;
+    return decl;
+}
+
+
+NumericOp *CodeBuilder::Numeric(Context *ctx, Tree *what)
+// ----------------------------------------------------------------------------
+//   Build unboxed code for arithmetic on typed parameters and constants
+// ----------------------------------------------------------------------------
+{
+    if (!what->AsInfix() && !what->AsPrefix())
+        return NULL;
+
+    NumericOp *numeric = new NumericOp(what->Position());
+    kind k = INTEGER;
+    if (Numeric(ctx, what, numeric, k) < 0 ||
+        numeric->instrs.size() > NumericOp::MAX_INSTRS)
+    {
+        delete numeric;
+        return NULL;
+    }
+
+    // Only worth it if at least one intermediate result stays unboxed,
+    // or if only constants are involved, since the result can be folded
+    uint ops = 0, loads = 0;
+    for (uint i = 0; i < numeric->instrs.size(); i++)
+    {
+        uint16 opcode = numeric->instrs[i].opcode;
+        if (opcode > NumericOp::INT_TO_REAL)
+            ops++;
+        else if (opcode == NumericOp::LOAD_INT ||
+                 opcode == NumericOp::LOAD_REAL)
+            loads++;
+    }
+    if (ops < 2 && loads)
+    {
+        delete numeric;
+        return NULL;
+    }
+
+    numeric->result = k;
+    IFTRACE(compile)
+        std::cerr << "NUMERIC " << what << ": "
+                  << numeric->instrs.size() << " instrs\n";
+    return numeric;
+}
+
+
+int CodeBuilder::Numeric(Context *ctx, Tree *what, NumericOp *op, kind &k)
+// ----------------------------------------------------------------------------
+//   Emit the register code for a subexpression, return the register or -1
+// ----------------------------------------------------------------------------
+{
+    if (op->instrs.size() >= NumericOp::MAX_INSTRS)
+        return -1;
+
+    switch(what->Kind())
+    {
+    case INTEGER:
+    {
+        uint r = op->Emit(NumericOp::CONST_INT);
+        op->instrs[r].value.i = ((Integer *) what)->value;
+        k = INTEGER;
+        return r;
+    }
+    case REAL:
+    {
+        uint r = op->Emit(NumericOp::CONST_REAL);
+        op->instrs[r].value.r = ((Real *) what)->value;
+        k = REAL;
+        return r;
+    }
+    case BLOCK:
+        return Numeric(ctx, ((Block *) what)->child, op, k);
+
+    case NAME:
+    {
+        // Only parameters declared as integer or real
+        Rewrite_p rw;
+        Scope_p   scope;
+        if (!ctx->Bound(what, true, &rw, &scope) || !rw)
+            return -1;
+        if (ScopeDepth(scope) != PARAMETER)
+            return -1;
+        TreeIDs::iterator found = inputs.find(rw);
+        Infix *typed = rw->left->AsInfix();
+        if (found == inputs.end() || !typed || typed->name != symColon)
+            return -1;
+        Tree *type = typed->right;
+        if (Name *name = type->AsName())
+            if (Tree *original = ctx->Bound(name))
+                type = original;
+        if (type == integer_type)
+            k = INTEGER;
+        else if (type == real_type)
+            k = REAL;
+        else
+            return -1;
+        return op->Emit(k == INTEGER ? NumericOp::LOAD_INT
+                                     : NumericOp::LOAD_REAL,
+                        0, 0, (*found).second);
+    }
+
+    case INFIX:
+    case PREFIX:
+    {
+        Infix  *ifx = what->AsInfix();
+        Tree   *left = ifx ? ifx->left : ((Prefix *) what)->right;
+        kind    lk = INTEGER, rk = INTEGER;
+        int     l = Numeric(ctx, left, op, lk);
+        if (l < 0)
+            return -1;
+        int     r = l;
+        if (ifx)
+        {
+            r = Numeric(ctx, ifx->right, op, rk);
+            if (r < 0)
+                return -1;
+        }
+
+        if (lk == NAME || rk == NAME)
+            return -1;
+
+        NumericLookup lookup(ctx, what, lk, rk);
+        ctx->Lookup(what, numericLookup, &lookup);
+        NumericOp::Builtin *builtin = lookup.builtin;
+        if (lookup.failed || !builtin)
+            return -1;
+        bool unary = (builtin->opcode == NumericOp::NEG ||
+                      builtin->opcode == NumericOp::NOT ||
+                      builtin->opcode == NumericOp::FNEG);
+        if (unary != !ifx)
+            return -1;
+
+        // Real opcodes accept integer arguments, convert them
+        if (builtin->args == REAL)
+        {
+            if (lk == INTEGER)
+                l = op->Emit(NumericOp::INT_TO_REAL, l);
+            if (ifx && rk == INTEGER)
+                r = op->Emit(NumericOp::INT_TO_REAL, r);
+        }
+        else if (lk != INTEGER || rk != INTEGER)
+        {
+            return -1;
+        }
+
+        // Boolean results are rejected above if used as arguments
+        k = builtin->result;
+        return op->Emit(builtin->opcode, l, r);
+    }
+
+    default:
+        break;
+    }
+    return -1;
 }
 
 
@@ -1018,9 +2181,12 @@ static Tree *compileLookup(Scope *evalScope, Scope *declScope,
                   << "(" << self << ") from "
                   << decl->left << "\n";
 
-    // Create the scope for evaluation
-    Context_p    context = new Context(evalScope);
-    Context_p    argsCtx = NULL;
+    // Borrow the contexts for evaluation and parameters. They are committed
+    // to the garbage collector only if the candidate generated code
+    PooledContext pooledContext(evalScope);
+    PooledContext pooledArgs(declScope, true);
+    Context *    context = pooledContext;
+    Context *    argsCtx = NULL;
 
     // Save current state of the builder
     Save<Tree_p>    saveSelf(builder->test, self);
@@ -1043,6 +2209,11 @@ static Tree *compileLookup(Scope *evalScope, Scope *declScope,
     Tree *defined = RewriteDefined(decl->left);
     bool isLeaf = defined->IsLeaf();
     CodeBuilder::strength strength = CodeBuilder::ALWAYS;
+
+    // Record where the candidate starts, in case we can dispatch
+    CodeBuilder::Candidate candidate = { builder->lastOp, false, -1, 0, NULL };
+    builder->dispatch.push_back(candidate);
+
     if (isLeaf)
     {
         if (defined != eliot_self && !Tree::Equal(defined, self))
@@ -1051,6 +2222,7 @@ static Tree *compileLookup(Scope *evalScope, Scope *declScope,
                 std::cerr << "COMPILE" << depth << ":" << cindex
                           << "(" << self << ") from constant "
                           << decl->left << " MISMATCH\n";
+            builder->dispatch.pop_back();
             builder->failOp = oldFailOp;
             delete failOp;
             return NULL;
@@ -1059,9 +2231,8 @@ static Tree *compileLookup(Scope *evalScope, Scope *declScope,
     }
     else
     {
-        // Create the scope for binding the parameters
-        argsCtx = new Context(declScope);
-        argsCtx->CreateScope();
+        // Use the scope for binding the parameters
+        argsCtx = pooledArgs;
         builder->argsCtx = argsCtx;
 
         // Remember the old end in case we did not generate code
@@ -1083,6 +2254,7 @@ static Tree *compileLookup(Scope *evalScope, Scope *declScope,
             for (uint i = lastInstrSize; i < lastNow; i++)
                 delete builder->instrs[i];
             builder->instrs.resize(lastInstrSize);
+            builder->dispatch.pop_back();
             builder->failOp = oldFailOp;
             builder->lastOp = lastOp;
             delete failOp;
@@ -1122,14 +2294,20 @@ static Tree *compileLookup(Scope *evalScope, Scope *declScope,
     else
     {
         // Normal case: evaluate body of the declaration in the new context
-        CallOp *call = builder->Call(argsCtx, decl->right,
+        Tree *body = decl->right;
+        Memo *memo = MemoInfo(decl);
+        if (memo)
+            body = memo->body;
+        CallOp *call = builder->Call(argsCtx, body,
                                      builder->resultType,
-                                     builder->outputs, builder->parms);
+                                     builder->outputs, builder->parms, memo);
         builder->Add(call);
     }
 
-    // Successful evaluation
+    // Successful evaluation, generated code may refer to the scopes
     builder->Success();
+    pooledContext.Keep();
+    pooledArgs.Keep();
 
     // Keep looking for other declarations
     IFTRACE(compile)
@@ -1143,13 +2321,18 @@ static Tree *compileLookup(Scope *evalScope, Scope *declScope,
 
 
 Function *CodeBuilder::Compile(Context *ctx, Tree *what,
-                               TreeIDs &callArgs, Tree *type)
+                               TreeIDs &callArgs, Tree *type, Scope *scope)
 // ----------------------------------------------------------------------------
 //    Compile the tree
 // ----------------------------------------------------------------------------
+//    The 'scope' is the scope the code depends on, by default the
+//    current scope of 'ctx'. Code is cached for each tree and scope.
 {
+    if (!scope)
+        scope = ctx->CurrentScope();
+
     // Check if we already compiled this particular tree (possibly recursive)
-    Function *function = what->GetInfo<Function>();
+    Function *function = Function::Cached(what, scope);
     if (function)
     {
         captured = function->captured;
@@ -1161,13 +2344,16 @@ Function *CodeBuilder::Compile(Context *ctx, Tree *what,
     uint nArgs = callArgs.size();
     Save<TreeIDs> saveInputs(inputs, callArgs);
     function = new Function(ctx, what, nArgs, 0);
+    function->Cache(scope);
     what->SetInfo<Code>(function);
 
     // Evaluate the input code
     bool result = true;
     Errors *errors = MAIN->errors;
     uint errCount = errors->Count();
-    if (ctx->ProcessDeclarations(what) && errCount == errors->Count())
+    bool hasInstrs = ctx->ProcessDeclarations(what);
+    function->epoch = Function::currentEpoch;
+    if (hasInstrs && errCount == errors->Count())
         result = Instructions(ctx, what);
 
     // Check if there is a result type, if so add a type check
@@ -1182,6 +2368,7 @@ Function *CodeBuilder::Compile(Context *ctx, Tree *what,
         function->nInputs = nArgs + captured.size();
         function->nLocals = nEvals + nParms + 2;
         function->captured = captured;
+        function->epoch = Function::currentEpoch;
 
         IFTRACE(ucode)
             std::cerr << "CODE " << what << "\n"
@@ -1191,7 +2378,8 @@ Function *CodeBuilder::Compile(Context *ctx, Tree *what,
     }
 
     // We failed, delete the result and return
-    what->Purge<Code>();
+    what->Remove<Code>(function);
+    delete function;
     return NULL;
 }
 
@@ -1243,11 +2431,35 @@ bool CodeBuilder::Instructions(Context *ctx, Tree *what)
     while (what)
     {
         Save<TreeIDs> saveEvals(values, values);
+        Save<Candidates> saveDispatch(dispatch, Candidates());
 
         // Create new success exit for this expression
         Op *success = new LabelOp("success");
         successOp = success;
 
+        // Arithmetic on typed values may run unboxed, with generic fallback
+        if (NumericOp *numeric = Numeric(ctx, what))
+        {
+            // Fold expressions that only involve constants
+            if (Tree_p folded = numeric->Fold())
+            {
+                delete numeric;
+                delete success;
+                successOp = NULL;
+                Add(new ConstOp(folded));
+                Code::Folded();
+                InstructionsSuccess(saveEvals.saved.size());
+                return true;
+            }
+
+            Op *generic = new LabelOp("generic");
+            numeric->fail = generic;
+            Add(numeric);
+            *lastOp = success;
+            lastOp = &generic->success;
+            instrs.push_back(generic);
+        }
+
         // Lookup candidates (and count them)
         Save<uint> saveCandidates(candidates, 0);
         ctx->Lookup(what, compileLookup, this);
@@ -1257,7 +2469,9 @@ bool CodeBuilder::Instructions(Context *ctx, Tree *what)
             // We found candidates. Join the failOp to the successOp
             ELIOT_ASSERT(!*lastOp && "Built code that is not NULL-terminated");
 
-            Add(new FormErrorOp(what));
+            Op *error = new FormErrorOp(what);
+            Add(error);
+            Dispatch(error);
             *lastOp = success;
 
             lastOp = &success->success;
@@ -1337,7 +2551,7 @@ bool CodeBuilder::Instructions(Context *ctx, Tree *what)
             // Create a call for forms like (X -> X+1) 31
             if (Infix *lifx = callee->AsInfix())
             {
-                if (lifx->name == "->")
+                if (lifx->name == symArrow)
                 {
                     TreeIDs   outs;
                     ParmOrder parms;
@@ -1412,10 +2626,10 @@ bool CodeBuilder::Instructions(Context *ctx, Tree *what)
         case INFIX:
         {
             Infix *infix = (Infix *) (Tree *) what;
-            text name = infix->name;
+            Symbol name = infix->name;
 
             // Check sequences
-            if (name == ";" || name == "\n")
+            if (name == symSequence || name == symNewline)
             {
                 // Sequences: evaluate left, then right
                 if (!Instructions(ctx, infix->left))
@@ -1425,7 +2639,7 @@ bool CodeBuilder::Instructions(Context *ctx, Tree *what)
             }
 
             // Check declarations
-            if (name == "->")
+            if (name == symArrow)
             {
                 // Declarations evaluate last non-declaration result, or self
                 InstructionsSuccess(saveEvals.saved.size());
@@ -1433,7 +2647,7 @@ bool CodeBuilder::Instructions(Context *ctx, Tree *what)
             }
 
             // Check scoped reference
-            if (name == ".")
+            if (name == symScope)
             {
                 if (!Instructions(ctx, infix->left))
                     return false;
@@ -1520,6 +2734,7 @@ int CodeBuilder::Evaluate(Context *ctx, Tree *self, bool deferEval)
     if (Name *name = self->AsName())
     {
         bool      evaluate = true;
+        bool      global = false;
         Rewrite_p rw;
         Scope_p   scope;
 
@@ -1536,9 +2751,10 @@ int CodeBuilder::Evaluate(Context *ctx, Tree *self, bool deferEval)
                 int inputId = (*found).second;
 
                 // Don't evaluate if already evaluated during argument passing
+                // or if passed along lazily to another call
                 Tree *type = RewriteType(rw->left);
                 evaluate = false;
-                if (!type || type == tree_type)
+                if (!deferEval && (!type || type == tree_type))
                 {
                     id = ValueID(rw);
                     Add(new ArgEvalOp(ctx, inputId, id, failOp));
@@ -1556,13 +2772,16 @@ int CodeBuilder::Evaluate(Context *ctx, Tree *self, bool deferEval)
                 id = ValueID(rw);
                 Op *code = CompileInternal(context, value, false);
                 AddEval(id, code);
+                if (!rw->GetInfo<InlinedValueInfo>())
+                    rw->SetInfo<InlinedValueInfo>(new InlinedValueInfo);
                 break;
             }
 
-            // Global entities can be evaluated directly in place
+            // Global entities are evaluated in place, checking the version
             case GLOBAL:
             {
                 id = ValueID(rw);
+                global = true;
                 break;
             }
 
@@ -1580,14 +2799,14 @@ int CodeBuilder::Evaluate(Context *ctx, Tree *self, bool deferEval)
             // Evaluate code associated to name if we need to
             if (evaluate)
             {
+                Op *code = NULL;
                 if (Opcode *opcode = value->GetInfo<Opcode>())
                 {
-                    Op *code = opcode->Clone();
-                    AddEval(id, code);
+                    code = opcode->Clone();
                 }
-                else if (Code *code = value->GetInfo<Code>())
+                else if (Code *valueCode = value->GetInfo<Code>())
                 {
-                    AddEval(id, code);
+                    code = valueCode;
                 }
                 else
                 {
@@ -1597,8 +2816,13 @@ int CodeBuilder::Evaluate(Context *ctx, Tree *self, bool deferEval)
                     Tree *type = RewriteType(rw->left);
                     CallOp *call = Call(ctx, value, type, noParmIDs, noParms);
                     instrs.push_back(call);
-                    AddEval(id, call);
+                    code = call;
                 }
+
+                if (global)
+                    Add(new GlobalOp(scope, rw, id, code, failOp));
+                else
+                    AddEval(id, code);
             }
 
             return id;
@@ -1628,13 +2852,19 @@ int CodeBuilder::EvaluationTemporary(Tree *self)
 
 
 CallOp *CodeBuilder::Call(Context *ctx, Tree *value, Tree *type,
-                          TreeIDs &parmIDs, ParmOrder &parms)
+                          TreeIDs &parmIDs, ParmOrder &parms, Memo *memo)
 // ----------------------------------------------------------------------------
 //   Generate the code sequence for a call
 // ----------------------------------------------------------------------------
 {
+    // Rewrite bodies depend on the declaration scope, not on the arguments
+    Scope *scope = ctx->CurrentScope();
+    if (ctx == argsCtx)
+        scope = ScopeParent(scope);
+
     TreeList captured;
-    Function *fn = CompileToBytecode(ctx, value, type, parmIDs, captured);
+    Function *fn = CompileToBytecode(ctx, value, type, parmIDs, captured,
+                                     scope);
 
     // Check if we captured values from the surrounding contexts
     if (uint csize = captured.size())
@@ -1653,7 +2883,9 @@ CallOp *CodeBuilder::Call(Context *ctx, Tree *value, Tree *type,
         nParms = np;
 
     // Output slot where we will pass paramters and generate call
-    CallOp *call = new CallOp(fn, ~0U, parms);
+    CallOp *call = memo
+        ? new MemoCallOp(fn, ~0U, parms, memo)
+        : new CallOp(fn, ~0U, parms);
     return call;
 }
 
@@ -1805,8 +3037,10 @@ CodeBuilder::strength CodeBuilder::DoInteger(Integer *what)
         return ival->value == what->value ? ALWAYS : NEVER;
     if (test->IsConstant())
         return NEVER;
-    Evaluate(context, test);
-    Add(new MatchOp<Integer>(what->value, failOp));
+    int id = Evaluate(context, test);
+    Op *match = new MatchOp<Integer>(what->value, failOp);
+    Add(match);
+    Guard(match, id, 1U << INTEGER, what);
     return SOMETIMES;
 }
 
@@ -1822,8 +3056,10 @@ CodeBuilder::strength CodeBuilder::DoReal(Real *what)
         return rval->value != what->value ? ALWAYS : NEVER;
     if (test->IsConstant())
         return NEVER;
-    Evaluate(context, test);
-    Add(new MatchOp<Real>(what->value, failOp));
+    int id = Evaluate(context, test);
+    Op *match = new MatchOp<Real>(what->value, failOp);
+    Add(match);
+    Guard(match, id, 1U << REAL);
     return SOMETIMES;
 }
 
@@ -1837,8 +3073,10 @@ CodeBuilder::strength CodeBuilder::DoText(Text *what)
         return tval->value != what->value ? ALWAYS : NEVER;
     if (test->IsConstant())
         return NEVER;
-    Evaluate(context, test);
-    Add(new MatchOp<Text>(what->value, failOp));
+    int id = Evaluate(context, test);
+    Op *match = new MatchOp<Text>(what->value, failOp);
+    Add(match);
+    Guard(match, id, 1U << TEXT, what);
     return SOMETIMES;
 }
 
@@ -1868,12 +3106,41 @@ CodeBuilder::strength CodeBuilder::DoName(Name *what)
         return SOMETIMES;
     }
 
-    Evaluate(context, test, true);
-    Bind(what, test);
+    int id = Evaluate(context, test, true);
+    Bind(what, test, id);
+    Thunk(context, test);
     return ALWAYS;
 }
 
 
+void CodeBuilder::Thunk(Context *ctx, Tree *value)
+// ----------------------------------------------------------------------------
+//   Compile the code for a deferred argument while building the caller
+// ----------------------------------------------------------------------------
+//   Global names are passed lazily as is, and forced by the callee each
+//   time it needs them. Other arguments were either evaluated before the
+//   call or are passed along from our own inputs.
+{
+    Name *name = value->AsName();
+    if (!name)
+        return;
+
+    Rewrite_p rw;
+    Scope_p   scope;
+    if (!ctx->Bound(name, true, &rw, &scope) || ScopeDepth(scope) != GLOBAL)
+        return;
+    if (Function::Cached(value, ctx->CurrentScope()))
+        return;
+
+    // The argument may never be forced: report errors if and when it is
+    TreeIDs  noParms;
+    TreeList noCaptures;
+    Errors   errors;
+    CompileToBytecode(ctx, value, NULL, noParms, noCaptures);
+    errors.Clear();
+}
+
+
 CodeBuilder::strength CodeBuilder::DoBlock(Block *what)
 // ----------------------------------------------------------------------------
 //   The pattern contains a block: look inside
@@ -1969,7 +3236,7 @@ CodeBuilder::strength CodeBuilder::DoInfix(Infix *what)
     Save<Context_p> saveContext(context, context);
 
     // Check if we have typed arguments, e.g. X:integer
-    if (what->name == ":")
+    if (what->name == symColon)
     {
         Name *name = what->left->AsName();
         if (!name)
@@ -1989,15 +3256,15 @@ CodeBuilder::strength CodeBuilder::DoInfix(Infix *what)
         {
             if (namedType == tree_type)
             {
-                Evaluate(context, test, true);
-                Bind(name, test);
+                int id = Evaluate(context, test, true);
+                Bind(name, test, id);
                 return ALWAYS;
             }
             if (Tree *cast = TypeCheck(context, namedType, test))
             {
                 test = cast;
-                Evaluate(context, test);
-                Bind(name, test, namedType);
+                int id = Evaluate(context, test);
+                Bind(name, test, id, namedType);
                 return ALWAYS;
             }
 
@@ -2007,14 +3274,14 @@ CodeBuilder::strength CodeBuilder::DoInfix(Infix *what)
         }
 
         // In all other cases, we need do perform dynamic evaluation to check
-        Evaluate(context, test);
+        int id = Evaluate(context, test);
         AddTypeCheck(context, test, type);
-        Bind(name, test, type);
+        Bind(name, test, id, type);
         return SOMETIMES;
     }
 
     // Check if we have typed declarations, e.g. X+Y as integer
-    if (what->name == "as")
+    if (what->name == symAs)
     {
         if (resultType)
         {
@@ -2026,7 +3293,7 @@ CodeBuilder::strength CodeBuilder::DoInfix(Infix *what)
     }
 
     // Check if we have a guard clause
-    if (what->name == "when")
+    if (what->name == symWhen)
     {
         // It must pass the rest (need to bind values first)
         if (what->left->Do(this) == NEVER)
@@ -2053,8 +3320,10 @@ CodeBuilder::strength CodeBuilder::DoInfix(Infix *what)
         uint rid = EvaluationTemporary(r);
 
         // Try to get an infix by evaluating what we have
-        Evaluate(context, test);
-        Add(new InfixMatchOp(what->name, failOp, lid, rid));
+        int id = Evaluate(context, test);
+        Op *match = new InfixMatchOp(what->name, failOp, lid, rid);
+        Add(match);
+        Guard(match, id, 1U << INFIX, what);
         str = SOMETIMES;
     }
 
@@ -2090,9 +3359,9 @@ CodeBuilder::strength CodeBuilder::DoLeftRight(Tree *wl, Tree *wr,
 }
 
 
-int CodeBuilder::Bind(Name *name, Tree *value, Tree *type)
+int CodeBuilder::Bind(Name *name, Tree *value, int id, Tree *type)
 // ----------------------------------------------------------------------------
-//   Enter a new binding in the current context
+//   Enter a new binding in the current context, 'id' is the value's ID
 // ----------------------------------------------------------------------------
 {
     ELIOT_ASSERT(inputs.find(name) == inputs.end() && "Binding name twice");
@@ -2109,12 +3378,812 @@ int CodeBuilder::Bind(Name *name, Tree *value, Tree *type)
     outputs[rw->left] = parmId;
 
     // Record parameter order for calls
-    uint id = ValueID(value);
     parms.push_back(id);
 
     return parmId;
 }
 
+
+
+// ============================================================================
+//
+//    Peephole optimization
+//
+// ============================================================================
+//
+//   After generation, frequent pairs of ops where the second one can only
+//   be reached from the first one are fused into superinstructions.
+//   Fused ops embed copies of the original ops, whose exits are only used
+//   to tell success from failure, and call their Run non-virtually.
+
+enum peephole
+{
+    PEEP_CONST_STORE, PEEP_EVAL_TYPECHECK, PEEP_EVAL_MATCH, PEEP_FOLD,
+    PEEP_MAX
+};
+static kstring peepholeNames[PEEP_MAX] =
+{
+    "const+store", "eval+typecheck", "eval+match", "constant fold"
+};
+static ulong peepholeCounts[PEEP_MAX] = { 0 };
+
+
+struct ConstStoreOp : Op
+// ----------------------------------------------------------------------------
+//   Evaluate a constant and store it
+// ----------------------------------------------------------------------------
+{
+    ConstStoreOp(ConstOp *cop, StoreOp *sop): value(cop->value), id(sop->id) {}
+    Tree_p value;
+    int    id;
+
+    virtual Op *        Run(Data data)
+    {
+        DataResult(data, value);
+        data[id] = value;
+        return success;
+    }
+    virtual kstring     OpID()  { return "const+store"; }
+    virtual void        Dump(std::ostream &out)
+    {
+        out << OpID() << "\t" << id << "\t" << value;
+    }
+};
+
+
+struct EvalTypeCheckOp : FailOp
+// ----------------------------------------------------------------------------
+//   Evaluate a value and check its type
+// ----------------------------------------------------------------------------
+{
+    EvalTypeCheckOp(EvalOp *e, TypeCheckOp *t)
+        : FailOp(e->fail), eval(e->id, e->ops, NULL),
+          check(t->value, t->type, NULL, t->builtin)
+    {
+        eval.success = &check;
+        check.success = this;
+    }
+    EvalOp      eval;
+    TypeCheckOp check;
+
+    virtual Op *        Run(Data data)
+    {
+        if (!eval.EvalOp::Run(data) || !check.TypeCheckOp::Run(data))
+            return fail;
+        return success;
+    }
+    virtual kstring     OpID()  { return "eval+typechk"; }
+    virtual void        Dump(std::ostream &out)
+    {
+        out << OpID() << "\t" << eval.id << ":";
+        if (check.builtin)
+            out << check.builtin->OpID();
+        else
+            out << check.type;
+        out << "\t" << Code::Ref(eval.ops, "\t", "code", "null");
+    }
+};
+
+
+template<class T>
+struct EvalMatchOp : FailOp
+// ----------------------------------------------------------------------------
+//   Evaluate a value and check that it matches a constant
+// ----------------------------------------------------------------------------
+{
+    EvalMatchOp(EvalOp *e, MatchOp<T> *m)
+        : FailOp(e->fail), eval(e->id, e->ops, NULL), match(m->ref, NULL)
+    {
+        eval.success = &match;
+        match.success = this;
+    }
+    EvalOp      eval;
+    MatchOp<T>  match;
+
+    virtual Op *        Run(Data data)
+    {
+        if (!eval.EvalOp::Run(data) || !match.MatchOp<T>::Run(data))
+            return fail;
+        return success;
+    }
+    virtual kstring     OpID()  { return "eval+match"; }
+    virtual void        Dump(std::ostream &out)
+    {
+        out << OpID() << "\t" << eval.id << "\t" << match.ref << "\t"
+            << Code::Ref(eval.ops, "\t", "code", "null");
+    }
+};
+
+
+template<class T>
+static Op *fuseEvalMatch(EvalOp *eval, Op *next)
+// ----------------------------------------------------------------------------
+//   Fuse an evaluation with a match of the given type
+// ----------------------------------------------------------------------------
+{
+    if (MatchOp<T> *match = dynamic_cast<MatchOp<T> *>(next))
+        if (match->fail == eval->fail)
+            return new EvalMatchOp<T>(eval, match);
+    return NULL;
+}
+
+
+static Op *fuse(Op *op, Op *next, peephole &kind)
+// ----------------------------------------------------------------------------
+//   Return a superinstruction for the two ops, or NULL
+// ----------------------------------------------------------------------------
+{
+    if (ConstOp *cop = dynamic_cast<ConstOp *>(op))
+    {
+        if (StoreOp *sop = dynamic_cast<StoreOp *>(next))
+        {
+            kind = PEEP_CONST_STORE;
+            return new ConstStoreOp(cop, sop);
+        }
+        return NULL;
+    }
+
+    // Flat code runs sub-sequences of evaluations inline, keep them as is
+    if (MAIN->options.threaded_code)
+        return NULL;
+
+    EvalOp *eval = dynamic_cast<EvalOp *>(op);
+    if (!eval)
+        return NULL;
+    if (TypeCheckOp *check = dynamic_cast<TypeCheckOp *>(next))
+    {
+        if (check->value != eval->id && check->type != eval->id)
+            return NULL;
+        if (check->fail != eval->fail)
+            return NULL;
+        kind = PEEP_EVAL_TYPECHECK;
+        return new EvalTypeCheckOp(eval, check);
+    }
+    kind = PEEP_EVAL_MATCH;
+    if (Op *fused = fuseEvalMatch<Integer>(eval, next))
+        return fused;
+    if (Op *fused = fuseEvalMatch<Real>(eval, next))
+        return fused;
+    if (Op *fused = fuseEvalMatch<Text>(eval, next))
+        return fused;
+    return NULL;
+}
+
+
+static void patch(Op *&op, std::map<Op *, Op *> &replaced)
+// ----------------------------------------------------------------------------
+//   Replace a reference to a fused op with the superinstruction
+// ----------------------------------------------------------------------------
+{
+    std::map<Op *, Op *>::iterator found = replaced.find(op);
+    if (found != replaced.end())
+        op = (*found).second;
+}
+
+
+void Code::Peephole(Op **entry, Ops &instrs)
+// ----------------------------------------------------------------------------
+//   Fuse pairs of ops where the second one is only reached from the first
+// ----------------------------------------------------------------------------
+{
+    typedef std::map<Op *, uint> Count;
+    typedef std::map<Op *, Op *> Replaced;
+    Count    preds;
+    Replaced replaced;
+    std::set<Op *> pinned;
+    uint     max = instrs.size();
+
+    // Count how many references each op has. Dispatch leads are pinned.
+    preds[*entry]++;
+    for (uint i = 0; i < max; i++)
+    {
+        Op *op = instrs[i];
+        preds[op->success]++;
+        preds[op->Fail()]++;
+        if (EvalOp *eval = dynamic_cast<EvalOp *>(op))
+            preds[eval->ops]++;
+        if (GlobalOp *global = dynamic_cast<GlobalOp *>(op))
+            preds[global->ops]++;
+        if (DispatchOp *dop = dynamic_cast<DispatchOp *>(op))
+        {
+            for (uint t = 0; t < dop->targets.size(); t++)
+                preds[dop->targets[t]]++;
+            pinned.insert(dop->lead);
+        }
+    }
+
+    // Find the pairs to fuse
+    Ops fused;
+    for (uint i = 0; i < max; i++)
+    {
+        Op *op = instrs[i];
+        Op *next = op->success;
+        if (!next || replaced.count(op) || replaced.count(next))
+            continue;
+        if (preds[next] != 1 || pinned.count(op) || pinned.count(next))
+            continue;
+        if (std::find(instrs.begin(), instrs.end(), next) == instrs.end())
+            continue;
+
+        peephole kind = PEEP_MAX;
+        if (Op *superOp = fuse(op, next, kind))
+        {
+            superOp->success = next->success;
+            replaced[op] = superOp;
+            replaced[next] = superOp;
+            fused.push_back(superOp);
+            peepholeCounts[kind]++;
+        }
+    }
+    if (!fused.size())
+        return;
+
+    // Replace the fused ops and patch references to them
+    Ops remaining;
+    for (uint i = 0; i < max; i++)
+    {
+        Op *op = instrs[i];
+        if (replaced.count(op))
+            delete op;
+        else
+            remaining.push_back(op);
+    }
+    remaining.insert(remaining.end(), fused.begin(), fused.end());
+    std::swap(instrs, remaining);
+
+    patch(*entry, replaced);
+    max = instrs.size();
+    for (uint i = 0; i < max; i++)
+    {
+        Op *op = instrs[i];
+        patch(op->success, replaced);
+        if (FailOp *fop = dynamic_cast<FailOp *>(op))
+            patch(fop->fail, replaced);
+        if (EvalOp *eval = dynamic_cast<EvalOp *>(op))
+            patch(eval->ops, replaced);
+        if (GlobalOp *global = dynamic_cast<GlobalOp *>(op))
+            patch(global->ops, replaced);
+        if (EvalTypeCheckOp *etc = dynamic_cast<EvalTypeCheckOp *>(op))
+            patch(etc->eval.ops, replaced);
+        if (EvalMatchOp<Integer> *em = dynamic_cast<EvalMatchOp<Integer>*>(op))
+            patch(em->eval.ops, replaced);
+        if (EvalMatchOp<Real> *em = dynamic_cast<EvalMatchOp<Real> *>(op))
+            patch(em->eval.ops, replaced);
+        if (EvalMatchOp<Text> *em = dynamic_cast<EvalMatchOp<Text> *>(op))
+            patch(em->eval.ops, replaced);
+        if (DispatchOp *dop = dynamic_cast<DispatchOp *>(op))
+            for (uint t = 0; t < dop->targets.size(); t++)
+                patch(dop->targets[t], replaced);
+    }
+}
+
+
+void Code::Folded()
+// ----------------------------------------------------------------------------
+//   Record that the code builder folded a constant expression
+// ----------------------------------------------------------------------------
+{
+    peepholeCounts[PEEP_FOLD]++;
+}
+
+
+void Code::DumpPeephole(std::ostream &out)
+// ----------------------------------------------------------------------------
+//   Report which fusions fired
+// ----------------------------------------------------------------------------
+{
+    out << "PEEPHOLE FUSIONS\n";
+    for (uint p = 0; p < PEEP_MAX; p++)
+        out << "\t" << peepholeNames[p] << "\t" << peepholeCounts[p] << "\n";
+}
+
+
+
+// ============================================================================
+//
+//    Profiling
+//
+// ============================================================================
+//
+//   With the -profile option, ops are run one at a time through the
+//   profiler, which counts executions, failures and cycles for each op,
+//   and calls for each code sequence. The cycles of an op exclude those
+//   of ops run while it runs, e.g. by a called function, so that the
+//   cycles of a code sequence are the sum of the cycles of its ops.
+//   The flat lowering is not used while profiling.
+
+Profiler *Profiler::profiler = NULL;
+
+
+ulonglong Profiler::Cycles()
+// ----------------------------------------------------------------------------
+//   Read the time stamp counter, or microseconds if there is none
+// ----------------------------------------------------------------------------
+{
+#if defined(__i386__) || defined(__x86_64__)
+    uint lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return (ulonglong(hi) << 32) | lo;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ulonglong(tv.tv_sec) * 1000000 + tv.tv_usec;
+#endif
+}
+
+
+Op *Profiler::Step(Op *op, Data data)
+// ----------------------------------------------------------------------------
+//   Run a single op and record its counts
+// ----------------------------------------------------------------------------
+{
+    ulonglong outer = nested;
+    nested = 0;
+    ulonglong start = Cycles();
+    Op *next = op->Run(data);
+    ulonglong elapsed = Cycles() - start;
+
+    Counts &counts = ops[op];
+    counts.count++;
+    if (next && next != op->success && next == op->Fail())
+        counts.fails++;
+    counts.cycles += elapsed - nested;
+    nested = outer + elapsed;
+    return next;
+}
+
+
+void Profiler::Execute(Code *code, Data data)
+// ----------------------------------------------------------------------------
+//   Run all the instructions in a code sequence
+// ----------------------------------------------------------------------------
+{
+    codes[code].count++;
+    Op *op = code->ops;
+    while (op)
+        op = Step(op, data);
+}
+
+
+void Profiler::Retire(Code *code)
+// ----------------------------------------------------------------------------
+//   Render the profile of a code about to be deleted
+// ----------------------------------------------------------------------------
+{
+    CodeCounts::iterator found = codes.find(code);
+    if (found == codes.end())
+        return;
+    retired.push_back(Render(code, (*found).second));
+    codes.erase(found);
+    for (Ops::iterator o = code->instrs.begin(); o != code->instrs.end(); o++)
+        ops.erase(*o);
+}
+
+
+static text jsonText(text value)
+// ----------------------------------------------------------------------------
+//   Quote a text for JSON output
+// ----------------------------------------------------------------------------
+{
+    std::ostringstream out;
+    out << '"';
+    for (uint i = 0; i < value.length(); i++)
+    {
+        char c = value[i];
+        switch(c)
+        {
+        case '"':       out << "\\\""; break;
+        case '\\':      out << "\\\\"; break;
+        case '\n':      out << "\\n"; break;
+        case '\t':      out << "\\t"; break;
+        default:
+            if ((byte) c < 0x20)
+                out << "\\u00" << "0123456789abcdef"[(c >> 4) & 0xF]
+                    << "0123456789abcdef"[c & 0xF];
+            else
+                out << c;
+        }
+    }
+    out << '"';
+    return out.str();
+}
+
+
+Profiler::Report Profiler::Render(Code *code, Counts &counts)
+// ----------------------------------------------------------------------------
+//   Render the annotated listing and the JSON for a code sequence
+// ----------------------------------------------------------------------------
+{
+    Report report;
+    counts.cycles = 0;
+    for (Ops::iterator o = code->instrs.begin(); o != code->instrs.end(); o++)
+        if (ops.count(*o))
+            counts.cycles += ops[*o].cycles;
+    report.cycles = counts.cycles;
+
+    std::ostringstream listing;
+    listing << "PROFILE\tcalls\t" << counts.count
+            << "\tcycles\t" << counts.cycles << "\n"
+            << "count\tfails\tcycles\n";
+    {
+        Save<Profiler *> saveProfile(currentProfile, this);
+        code->Dump(listing);
+    }
+    report.listing = listing.str();
+
+    std::ostringstream json, self;
+    self << code->self;
+    json << "{\"kind\": " << jsonText(code->OpID())
+         << ", \"self\": " << jsonText(self.str())
+         << ", \"calls\": " << counts.count
+         << ", \"cycles\": " << counts.cycles
+         << ", \"ops\": [";
+    uint max = code->instrs.size();
+    for (uint i = 0; i < max; i++)
+    {
+        Op *op = code->instrs[i];
+        Counts opCounts = ops.count(op) ? ops[op] : Counts();
+        std::ostringstream name;
+        op->Dump(name);
+        json << (i ? ",\n    " : "\n    ")
+             << "{\"index\": " << i
+             << ", \"op\": " << jsonText(name.str())
+             << ", \"count\": " << opCounts.count
+             << ", \"fails\": " << opCounts.fails
+             << ", \"cycles\": " << opCounts.cycles << "}";
+    }
+    json << "]}";
+    report.json = json.str();
+    return report;
+}
+
+
+void Profiler::Annotate(std::ostream &out, Op *op)
+// ----------------------------------------------------------------------------
+//   Prefix an instruction in a listing with its counts
+// ----------------------------------------------------------------------------
+{
+    OpCounts::iterator found = ops.find(op);
+    if (found == ops.end())
+    {
+        out << "-\t-\t-\t";
+        return;
+    }
+    Counts &counts = (*found).second;
+    out << counts.count << "\t" << counts.fails << "\t" << counts.cycles << "\t";
+}
+
+
+void Profiler::Dump(std::ostream &listing, std::ostream &json)
+// ----------------------------------------------------------------------------
+//   Output the profile of all code that ran, most expensive first
+// ----------------------------------------------------------------------------
+{
+    Reports reports = retired;
+    for (CodeCounts::iterator c = codes.begin(); c != codes.end(); c++)
+        reports.push_back(Render((*c).first, (*c).second));
+    std::stable_sort(reports.begin(), reports.end());
+
+    json << "{\"codes\": [";
+    uint max = reports.size();
+    for (uint r = 0; r < max; r++)
+    {
+        listing << reports[r].listing << "\n";
+        json << (r ? ",\n  " : "\n  ") << reports[r].json;
+    }
+    json << "]}\n";
+}
+
+
+
+// ============================================================================
+//
+//    Flat threaded-code lowering
+//
+// ============================================================================
+//
+//   With the -flat option, the linked ops of a code sequence are lowered
+//   to a contiguous array of instructions, with integer operands and
+//   indices for the success and fail exits, and run by a switch loop.
+//   Ops that are not simple data moves or tests keep their virtual Run,
+//   which is called from the loop ('generic' instructions).
+
+ThreadedCode::ThreadedCode(Code *code)
+// ----------------------------------------------------------------------------
+//   Lower the instructions of the code into a flat array
+// ----------------------------------------------------------------------------
+    : instrs(), jumps(), entry(END), valid(true)
+{
+    typedef std::map<Op *, uint32> OpIndex;
+    Ops    &ops = code->instrs;
+    uint    max = ops.size();
+    OpIndex index;
+
+    // Assign an index to every op, NULL is the end of the sequence
+    for (uint i = 0; i < max; i++)
+        index[ops[i]] = i;
+    index[NULL] = END;
+
+    // Ops that jump outside of our own instructions can't be lowered
+    for (uint i = 0; i < max && valid; i++)
+    {
+        if (!index.count(ops[i]->success) || !index.count(ops[i]->Fail()))
+            valid = false;
+        if (DispatchOp *dop = dynamic_cast<DispatchOp *>(ops[i]))
+            for (uint t = 0; t < dop->targets.size(); t++)
+                if (!index.count(dop->targets[t]))
+                    valid = false;
+    }
+    if (!valid || !index.count(code->ops))
+    {
+        valid = false;
+        return;
+    }
+
+    entry = index[code->ops];
+    instrs.resize(max);
+    for (uint i = 0; i < max; i++)
+    {
+        Op    *op = ops[i];
+        Instr &ins = instrs[i];
+        ins.opcode = GENERIC;
+        ins.a = ins.b = 0;
+        ins.next = index[op->success];
+        ins.fail = index[op->Fail()];
+        ins.op = op;
+
+        if (dynamic_cast<ConstOp *>(op))
+        {
+            ins.opcode = CONST;
+        }
+        else if (dynamic_cast<SelfOp *>(op))
+        {
+            ins.opcode = SELF;
+        }
+        else if (ValueOp *vop = dynamic_cast<ValueOp *>(op))
+        {
+            ins.opcode = VALUE;
+            ins.a = vop->id;
+        }
+        else if (StoreOp *sop = dynamic_cast<StoreOp *>(op))
+        {
+            ins.opcode = STORE;
+            ins.a = sop->id;
+        }
+        else if (ClearOp *cop = dynamic_cast<ClearOp *>(op))
+        {
+            ins.opcode = CLEAR;
+            ins.a = cop->lo;
+            ins.b = cop->hi;
+        }
+        else if (EvalOp *eop = dynamic_cast<EvalOp *>(op))
+        {
+            // Only sub-sequences within our own code are inlined
+            if (eop->ops && index.count(eop->ops))
+            {
+                ins.opcode = EVAL;
+                ins.a = eop->id;
+                ins.b = index[eop->ops];
+            }
+        }
+        else if (WhenClauseOp *wop = dynamic_cast<WhenClauseOp *>(op))
+        {
+            ins.opcode = WHEN;
+            ins.a = wop->whenID;
+        }
+        else if (NameMatchOp *nop = dynamic_cast<NameMatchOp *>(op))
+        {
+            ins.opcode = MATCH_NAME;
+            ins.a = nop->testID;
+            ins.b = nop->nameID;
+        }
+        else if (dynamic_cast<MatchOp<Integer> *>(op))
+        {
+            ins.opcode = MATCH_INTEGER;
+        }
+        else if (dynamic_cast<MatchOp<Real> *>(op))
+        {
+            ins.opcode = MATCH_REAL;
+        }
+        else if (ConstStoreOp *csop = dynamic_cast<ConstStoreOp *>(op))
+        {
+            ins.opcode = CONST_STORE;
+            ins.a = csop->id;
+        }
+        else if (DispatchOp *dop = dynamic_cast<DispatchOp *>(op))
+        {
+            ins.opcode = DISPATCH;
+            ins.a = jumps.size();
+            for (uint t = 0; t < dop->targets.size(); t++)
+                jumps.push_back(index[dop->targets[t]]);
+        }
+    }
+}
+
+
+void ThreadedCode::Run(Data data, uint32 pc)
+// ----------------------------------------------------------------------------
+//   Run instructions starting at the given index until the end
+// ----------------------------------------------------------------------------
+{
+    Instr *code = &instrs[0];
+    while (pc != END)
+    {
+        Instr &ins = code[pc];
+        switch(ins.opcode)
+        {
+        case CONST:
+            DataResult(data, ((ConstOp *) ins.op)->value);
+            pc = ins.next;
+            break;
+
+        case SELF:
+            pc = ins.next;
+            break;
+
+        case VALUE:
+            DataResult(data, data[ins.a]);
+            pc = ins.next;
+            break;
+
+        case STORE:
+            data[ins.a] = DataResult(data);
+            pc = ins.next;
+            break;
+
+        case CLEAR:
+            for (int v = ins.a; v <= ins.b; v++)
+                data[v] = NULL;
+            pc = ins.next;
+            break;
+
+        case EVAL:
+            if (Tree *result = data[ins.a])
+            {
+                DataResult(data, result);
+                pc = ins.next;
+                break;
+            }
+            Run(data, ins.b);
+            if (Tree *result = DataResult(data))
+            {
+                data[ins.a] = result;
+                pc = ins.next;
+                break;
+            }
+            pc = ins.fail;
+            break;
+
+        case WHEN:
+            pc = data[ins.a] == eliot_true ? ins.next : ins.fail;
+            break;
+
+        case MATCH_NAME:
+            pc = Tree::Equal(data[ins.b], data[ins.a]) ? ins.next : ins.fail;
+            break;
+
+        case MATCH_INTEGER:
+        {
+            Integer *ival = DataResult(data)->As<Integer>();
+            MatchOp<Integer> *mop = (MatchOp<Integer> *) ins.op;
+            pc = ival && ival->value == mop->ref ? ins.next : ins.fail;
+            break;
+        }
+
+        case MATCH_REAL:
+        {
+            Real *rval = DataResult(data)->As<Real>();
+            MatchOp<Real> *mop = (MatchOp<Real> *) ins.op;
+            pc = rval && rval->value == mop->ref ? ins.next : ins.fail;
+            break;
+        }
+
+        case CONST_STORE:
+        {
+            Tree *value = ((ConstStoreOp *) ins.op)->value;
+            DataResult(data, value);
+            data[ins.a] = value;
+            pc = ins.next;
+            break;
+        }
+
+        case DISPATCH:
+        {
+            int pos = ((DispatchOp *) ins.op)->Select(data);
+            pc = pos < 0 ? ins.fail : jumps[ins.a + pos];
+            break;
+        }
+
+        case GENERIC:
+        default:
+        {
+            Op *op = ins.op;
+            Op *next = op->Run(data);
+            if (next && next == op->success)
+                pc = ins.next;
+            else if (next && next == op->Fail())
+                pc = ins.fail;
+            else
+                pc = END;
+            break;
+        }
+        }
+    }
+}
+
+
+void ThreadedCode::Dump(std::ostream &out)
+// ----------------------------------------------------------------------------
+//   Dump the flat instructions
+// ----------------------------------------------------------------------------
+{
+    static kstring names[] = { "generic", "const", "self", "value", "store",
+                               "clear", "eval", "when", "match\tname",
+                               "match\tinteger", "match\treal", "dispatch",
+                               "const+store" };
+    uint max = instrs.size();
+    for (uint i = 0; i < max; i++)
+    {
+        Instr &ins = instrs[i];
+        out << (i == entry ? "=>" : "") << i << "\t" << names[ins.opcode]
+            << "\t" << ins.a << "," << ins.b;
+        if (ins.next != END)
+            out << "\tnext " << ins.next;
+        if (ins.fail != END)
+            out << "\tfail " << ins.fail;
+        if (ins.opcode == GENERIC)
+            out << "\t" << ins.op->OpID();
+        if (DispatchOp *dop = ins.opcode == DISPATCH
+                            ? (DispatchOp *) ins.op : NULL)
+            for (uint t = 0; t < dop->targets.size(); t++)
+                out << (t ? "," : "\tcases ") << jumps[ins.a + t];
+        out << "\n";
+    }
+}
+
+
+void Code::Execute(Data data)
+// ----------------------------------------------------------------------------
+//   Run the instructions, using the flat lowering if selected
+// ----------------------------------------------------------------------------
+{
+    if (Profiler *profiler = Profiler::profiler)
+    {
+        profiler->Execute(this, data);
+        return;
+    }
+
+    if (MAIN->options.threaded_code)
+    {
+        if (!threaded)
+        {
+            threaded = new ThreadedCode(this);
+            IFTRACE(ucode)
+            {
+                std::cerr << "FLAT " << self;
+                if (threaded->valid)
+                {
+                    std::cerr << "\n";
+                    threaded->Dump(std::cerr);
+                }
+                else
+                {
+                    std::cerr << " NOT LOWERED\n";
+                }
+            }
+        }
+        if (threaded->valid)
+        {
+            threaded->Run(data, threaded->entry);
+            return;
+        }
+    }
+
+    Op *op = ops;
+    while (op)
+        op = op->Run(data);
+}
+
 ELIOT_END
 
 
@@ -45,12 +45,17 @@ struct Op;                      // An individual operation
 struct Code;                    // A sequence of operations
 struct Function;                // Internal representation of functions
 struct CallOp;                  // A call operation
+struct NumericOp;               // Unboxed arithmetic
 struct CodeBuilder;             // Code generator
+struct ThreadedCode;            // Flat lowering of a code sequence
+struct Memo;                    // Cache for memoized rewrites
 typedef std::vector<Op *> Ops;  // Sequence of operations
 typedef std::map<Tree *, int>  TreeIDs;
 typedef std::map<Tree *, Op *> TreeOps;
 typedef std::vector<int>       ParmOrder;
-typedef Tree_p *               Data;
+typedef FramePtr<Tree>         Slot;   // Not counted with -deferred
+typedef Slot *                 Data;
+typedef std::vector<Slot>      Slots;
 
 
 
@@ -62,7 +67,10 @@ typedef Tree_p *               Data;
 
 Tree *          EvaluateWithBytecode(Context *context, Tree *input);
 Function *      CompileToBytecode(Context *context, Tree *input, Tree *type,
-                                  TreeIDs &parms, TreeList &captured);
+                                  TreeIDs &parms, TreeList &captured,
+                                  Scope *scope = NULL);
+Tree *          CallWithBytecode(Scope *declScope, Infix *decl, Tree *type,
+                                 TreeList &names, TreeList &args);
 
 
 
@@ -103,11 +111,15 @@ struct Code : Op, Info
     ~Code();
 
     virtual Op *        Run(Data data);
+    void                Execute(Data data);
 
     void                SetOps(Op **ops, Ops *instr, uint outId);
     virtual void        Dump(std::ostream &out);
     static void         Dump(std::ostream &out, Op *ops, Ops &instrs);
     static text         Ref(Op *op, text sep, text set, text null);
+    static void         Peephole(Op **ops, Ops &instrs);
+    static void         Folded();
+    static void         DumpPeephole(std::ostream &out);
     virtual uint        Inputs()        { return 0; }
     virtual uint        Locals()        { return 0; }
     virtual kstring     OpID()          { return "code"; }
@@ -117,6 +129,7 @@ public:
     Tree_p              self;
     Op *                ops;
     Ops                 instrs;
+    ThreadedCode *      threaded;
 };
 
 
@@ -140,9 +153,72 @@ struct Function : Code
     uint                OffsetSize()    { return Inputs() + Closures(); }
     uint                FrameSize()     { return 2 + OffsetSize() + Locals(); }
 
+    // Cache of compiled code, keyed by tree and defining scope
+    static Function *   Cached(Tree *what, Scope *scope);
+    void                Cache(Scope *scope);
+    static void         ScopeChanged(Scope *scope);
+    static void         ValueChanged(Scope *scope, Infix *decl, Tree *old);
+
 public:
     uint                nInputs, nLocals;
     TreeList            captured;
+    Scope_p             scope;          // Scope the code was compiled for
+    ulong               epoch;          // Epoch when code was compiled
+    static ulong        currentEpoch;   // Bumped when a cached scope changes
+};
+
+
+struct CompiledScopeInfo : Info
+// ----------------------------------------------------------------------------
+//   Mark scopes that cached functions depend on
+// ----------------------------------------------------------------------------
+{};
+
+
+struct InlinedValueInfo : Info
+// ----------------------------------------------------------------------------
+//   Mark declarations whose value was compiled into the code reading it
+// ----------------------------------------------------------------------------
+{};
+
+
+struct Profiler
+// ----------------------------------------------------------------------------
+//   Record execution counts and cycles per op and per code (-profile)
+// ----------------------------------------------------------------------------
+{
+    struct Counts
+    {
+        Counts(): count(0), fails(0), cycles(0) {}
+        ulonglong       count, fails, cycles;
+    };
+    struct Report
+    {
+        ulonglong       cycles;
+        text            listing;
+        text            json;
+        bool operator<(const Report &o) const { return cycles > o.cycles; }
+    };
+    typedef std::map<Op *, Counts>      OpCounts;
+    typedef std::map<Code *, Counts>    CodeCounts;
+    typedef std::vector<Report>         Reports;
+
+    Profiler(): ops(), codes(), retired(), nested(0) {}
+
+    static ulonglong    Cycles();
+    Op *                Step(Op *op, Data data);
+    void                Execute(Code *code, Data data);
+    void                Retire(Code *code);
+    Report              Render(Code *code, Counts &counts);
+    void                Annotate(std::ostream &out, Op *op);
+    void                Dump(std::ostream &listing, std::ostream &json);
+
+public:
+    OpCounts            ops;
+    CodeCounts          codes;
+    Reports             retired;
+    ulonglong           nested;         // Cycles of ops run by current op
+    static Profiler *   profiler;
 };
 
 
@@ -162,7 +238,8 @@ struct CodeBuilder
     ~CodeBuilder();
 
 public:
-    Function *  Compile(Context *context,Tree *tree,TreeIDs &parms,Tree *type);
+    Function *  Compile(Context *context,Tree *tree,TreeIDs &parms,Tree *type,
+                        Scope *scope = NULL);
     Op *        CompileInternal(Context *context, Tree *what, bool defer);
     bool        Instructions(Context *context, Tree *tree);
 
@@ -187,9 +264,10 @@ public:
     int         Evaluate(Context *, Tree *, bool deferEval = false);
     int         EvaluationTemporary(Tree *);
     void        Enclose(Context *context, Scope *old, Tree *what);
-    int         Bind(Name *name, Tree *value, Tree *type=NULL);
+    int         Bind(Name *name, Tree *value, int id, Tree *type=NULL);
+    void        Thunk(Context *context, Tree *value);
     CallOp *    Call(Context *context, Tree *value, Tree *type,
-                     TreeIDs &inputs, ParmOrder &parms);
+                     TreeIDs &inputs, ParmOrder &parms, Memo *memo = NULL);
 
     // Contexts management
     enum depth  { LOCAL, PARAMETER, ENCLOSING, GLOBAL };
@@ -200,6 +278,14 @@ public:
     void        AddEval(int id, Op *op);
     void        AddTypeCheck(Context *, Tree *value, Tree *type);
 
+    // Unboxed arithmetic on typed parameters and constants
+    NumericOp * Numeric(Context *context, Tree *what);
+    int         Numeric(Context *context, Tree *what, NumericOp *op, kind &k);
+
+    // Dispatch between candidates based on the first value they test
+    void        Guard(Op *guard, int id, uint kinds, Tree *value = NULL);
+    void        Dispatch(Op *none);
+
     // Success at end of declaration
     void        Success();
     void        InstructionsSuccess(uint oldNumEvals);
@@ -226,6 +312,18 @@ public:
     TreeOps     subexprs;       // Code generated for sub-expressions
     ParmOrder   parms;          // Indices for parameters
     bool        defer;          // Deferred evaluation
+
+public:
+    struct Candidate
+    {
+        Op **   slot;           // Where the code for the candidate starts
+        bool    guarded;        // A first guard was seen for the candidate
+        int     id;             // Value tested by the first guard, or -1
+        uint    kinds;          // Mask of value kinds the guard accepts
+        Tree_p  value;          // Constant or infix the value must match
+    };
+    typedef std::vector<Candidate> Candidates;
+    Candidates  dispatch;       // Candidates for the current form
 };
 
 
@@ -286,7 +384,7 @@ inline Tree *DataArg(Data data, uint index)
 //    Return the Nth input argument
 // ----------------------------------------------------------------------------
 {
-    return data[~index];
+    return data[~(int) index];
 }
 
 
@@ -46,6 +46,7 @@
 #include "parms.h"
 #include "options.h"
 #include "context.h"
+#include "interpreter.h"
 #include "renderer.h"
 #include "runtime.h"
 #include "errors.h"
@@ -142,6 +143,7 @@ Compiler::Compiler(kstring moduleName, int argc, char **argv)
     Allocator<Prefix>   ::Singleton()->AddListener(cgcl);
     Allocator<Postfix>  ::Singleton()->AddListener(cgcl);
     Allocator<Block>    ::Singleton()->AddListener(cgcl);
+    Allocator<Closure>  ::Singleton()->AddListener(cgcl);
 
     // Create the runtime environment for just-in-time compilation
     runtime = LLVMS_InitializeJIT(llvm, moduleName, &module);
@@ -724,7 +726,7 @@ Value *Compiler::EnterGlobal(Name *name, Name_p *address)
     bool isConstant = false;
     GlobalValue *result = new GlobalVariable (*module, treePtrTy, isConstant,
                                               GlobalVariable::ExternalLinkage,
-                                              null, name->value);
+                                              null, name->value.Value());
     SetTreeGlobal(name, result, address);
 
     IFTRACE(llvm)
@@ -60,6 +60,7 @@
 
 #include <iostream>
 #include <cstdlib>
+#include <stdio.h>
 #include <sstream>
 #include <sys/stat.h>
 
@@ -76,6 +77,7 @@ ELIOT_BEGIN
 
 
 uint Context::hasRewritesForKind = 0;
+Dependencies *Context::dependencies = NULL;
 
 Context::Context()
 // ----------------------------------------------------------------------------
@@ -121,6 +123,103 @@ Context::~Context()
 
 
 
+// ============================================================================
+//
+//    Contexts borrowed by lookups
+//
+// ============================================================================
+
+PooledContext::Entries *PooledContext::pool = NULL;
+uint  PooledContext::used    = 0;
+ulong PooledContext::reused  = 0;
+ulong PooledContext::escaped = 0;
+
+
+PooledContext::PooledContext(Scope *parent, bool createScope)
+// ----------------------------------------------------------------------------
+//   Borrow a context for 'parent', possibly with a new local scope
+// ----------------------------------------------------------------------------
+    : context(NULL), scope(NULL), index(used++), keep(false)
+{
+    // The pool is never deleted, it may be used until the GC shuts down
+    if (!pool)
+        pool = new Entries;
+    if (index >= pool->size())
+        pool->resize(index + 1);
+
+    Entry &entry = (*pool)[index];
+    if (entry.context)
+    {
+        entry.context->symbols = parent;
+        reused++;
+    }
+    else
+    {
+        entry.context = new Context(parent);
+    }
+    context = entry.context;
+
+    if (createScope)
+    {
+        if (entry.scope)
+            entry.scope->left = parent;
+        else
+            entry.scope = new Scope(parent, eliot_nil);
+        scope = entry.scope;
+        context->symbols = scope;
+    }
+}
+
+
+PooledContext::~PooledContext()
+// ----------------------------------------------------------------------------
+//   Give the context back to the pool, unless it escaped
+// ----------------------------------------------------------------------------
+//   The pool holds one reference to the context and to the scope, and the
+//   context holds another one to the scope. Any other reference means that
+//   the objects must outlive the lookup. Scopes that code was compiled for
+//   are also recorded by address, and carry an info. The only info a scope
+//   that did not escape may have is the filter of its bindings.
+{
+    ELIOT_ASSERT(index == used - 1 && "Pooled contexts released out of order");
+    used--;
+
+    Entry &entry = (*pool)[index];
+    typedef TypeAllocator TA;
+    bool escapes = keep || TA::RefCount(context) != 1;
+    ScopeFilter *filter = NULL;
+    if (scope && !escapes)
+    {
+        Info *info = scope->info;
+        if (info)
+            filter = dynamic_cast<ScopeFilter *>(info);
+        escapes = context->symbols != scope ||
+                  TA::RefCount(scope) != 2 ||
+                  (info && (!filter || (Info *) info->next));
+    }
+
+    if (escapes)
+    {
+        entry.context = NULL;
+        entry.scope = NULL;
+        escaped++;
+        return;
+    }
+
+    // Drop the bindings and parent so that they can be collected
+    context->symbols = NULL;
+    context->compiled.clear();
+    if (scope)
+    {
+        scope->left = eliot_nil;
+        scope->right = eliot_nil;
+        if (filter)
+            filter->bits = 0;
+    }
+}
+
+
+
 // ============================================================================
 // 
 //    High-level evaluation functions
@@ -162,18 +261,28 @@ eval_fn Context::Compile(Tree *what)
 //   Evaluate 'what' in the given context
 // ----------------------------------------------------------------------------
 {
-    eval_fn code = compiled[what];
+    eval_fn code = compiled[what].code;
 
 #ifndef INTERPRETER_ONLY
     if (!code)
     {
+        // Record the lookups the code depends on, see Invalidate()
+        Dependencies  uses;
+        Dependencies *outer = dependencies;
+        dependencies = &uses;
         code = MAIN->compiler->Compile(this, what);
+        dependencies = outer;
+        if (outer)
+            outer->insert(uses.begin(), uses.end());
+
         if (!code)
         {
             Ooops("Error compiling $1", what);
             return NULL;
         }
-        compiled[what] = code;
+        CompiledCode &entry = compiled[what];
+        entry.code = code;
+        entry.uses.swap(uses);
     }
 #endif // INTERPRETER_ONLY
 
@@ -198,13 +307,15 @@ Tree *Context::Evaluate(Tree *what)
         if (eval_fn code = Compile(what))
             result = code(this->CurrentScope(), what);
         break;
-    case 2:
-        // Compilation of bytecode not implemented yet, fall through for now
-        
 #endif // INTERPRETER_ONLY
 
+    case 2:
+        // Adaptive mode: interpret, hot rewrites are run as bytecode
+        result = EvaluateAdaptive(what);
+        break;
+
     default:
-        // Compile at O1 for all cases, O2 and O3 in interpreter-only mode
+        // Compile at O1 for all cases, O3 in interpreter-only mode
         result = ELIOT::EvaluateWithBytecode(this, what);
         break;
     case 0:
@@ -217,6 +328,38 @@ Tree *Context::Evaluate(Tree *what)
 }
 
 
+Tree *Context::EvaluateAdaptive(Tree *what)
+// ----------------------------------------------------------------------------
+//   Evaluate at -O2, compiling programs that are evaluated often
+// ----------------------------------------------------------------------------
+//   Short-lived programs stay in the interpreter, which promotes rewrites
+//   to bytecode once they are called often enough (see -promote).
+//   When LLVM is available, programs evaluated repeatedly, e.g. code sent
+//   to a listening process, are compiled to machine code (see -jit).
+{
+#ifndef INTERPRETER_ONLY
+    TierInfo *tier = what->GetInfo<TierInfo>();
+    if (!tier)
+    {
+        tier = new TierInfo;
+        what->SetInfo<TierInfo>(tier);
+    }
+    if (!tier->failed && tier->count >= MAIN->options.jit_evaluations)
+    {
+        if (eval_fn code = Compile(what))
+            return code(this->CurrentScope(), what);
+        tier->failed = true;
+    }
+    else if (tier->count < MAIN->options.jit_evaluations)
+    {
+        tier->count++;
+    }
+#endif // INTERPRETER_ONLY
+
+    return ELIOT::Evaluate(this, what);
+}
+
+
 Tree *Context::Call(text prefix, TreeList &argList)
 // ----------------------------------------------------------------------------
 //    Generate a call and evaluate it
@@ -259,18 +402,18 @@ bool Context::ProcessDeclarations(Tree *what)
         bool isInstruction = true;
         if (Infix *infix = what->AsInfix())
         {
-            if (infix->name == "->")
+            if (infix->name == symArrow)
             {
                 Enter(infix);
                 isInstruction = false;
             }
-            else if (infix->name == "\n" || infix->name == ";")
+            else if (infix->name == symNewline || infix->name == symSequence)
             {
                 // Chain of declarations, avoiding recursing if possible.
                 if (Infix *left = infix->left->AsInfix())
                 {
                     isInstruction = false;
-                    if (left->name == "->")
+                    if (left->name == symArrow)
                         Enter(left);
                     else
                         isInstruction = ProcessDeclarations(left);
@@ -401,7 +544,7 @@ Rewrite *Context::Enter(Infix *rewrite, bool overwrite)
 // ----------------------------------------------------------------------------
 {
     // If the rewrite is not good, just exit
-    if (rewrite->name != "->")
+    if (rewrite->name != symArrow)
         return NULL;
 
     // In interpreted mode, just skip any C declaration
@@ -413,16 +556,17 @@ Rewrite *Context::Enter(Infix *rewrite, bool overwrite)
                 if (cname->value == "C")
                     return NULL;
 
-    // Updating a symbol in the context invalidates any cached code we may have
-    compiled.clear();
-
     // Find 'from', 'to' and 'hash' for the rewrite
     Tree *from = rewrite->left;
     
     // Check what we are really defining, and verify if it's a name
     Tree *defined = RewriteDefined(from);
     Name *name = defined->AsName();
-    ulong h = Hash(defined);
+    ulong h0 = Hash(defined);
+    ulong h = h0;
+
+    // Updating a symbol invalidates cached code that looked it up
+    Invalidate(symbols, h0);
 
     // Record which kinds we have rewrites for
     HasOneRewriteFor(defined->Kind());
@@ -442,6 +586,7 @@ Rewrite *Context::Enter(Infix *rewrite, bool overwrite)
     Tree_p  &locals = scope->right;
     Tree_p  *parent = &locals;
     Rewrite *result = NULL;
+    uint     depth  = 0;
     while (!result)
     {
         // If we have found a nil spot, that's where we can insert
@@ -459,6 +604,23 @@ Rewrite *Context::Enter(Infix *rewrite, bool overwrite)
 
             // Insert the entry in the parent
             *parent = entry;
+            ScopeFilter *filter = scope->GetInfo<ScopeFilter>();
+            if (!filter && locals == entry)
+            {
+                filter = new ScopeFilter;
+                scope->SetInfo<ScopeFilter>(filter);
+            }
+            if (filter)
+                filter->Add(h0);
+            Function::ScopeChanged(scope);
+            LookupCache::ScopeChanged(scope);
+
+            // Index the entry in the hash table if the trie is deep
+            ScopeTable *table = scope->GetInfo<ScopeTable>();
+            if (table && table->rewrites == locals)
+                table->Add(h0, rewrite);
+            else if (depth >= ScopeTable::MIN_DEPTH)
+                ScopeTable::Build(scope);
 
             // We are done
             result = entry;
@@ -468,10 +630,14 @@ Rewrite *Context::Enter(Infix *rewrite, bool overwrite)
         // This should be a rewrite entry, follow it
         Rewrite *entry = (*parent)->AsInfix();
 
+        // Entering the same declaration again (e.g. recompiling) is a no-op
+        Infix *decl = RewriteDeclaration(entry);
+        if (decl == rewrite)
+            return entry;
+
         // If we are definig a name, signal if we redefine it
         if (name)
         {
-            Infix *decl = RewriteDeclaration(entry);
             Tree *declDef = RewriteDefined(decl->left);
             if (Name *declName = declDef->AsName())
             {
@@ -480,6 +646,7 @@ Rewrite *Context::Enter(Infix *rewrite, bool overwrite)
                     if (overwrite)
                     {
                         decl->right = rewrite->right;
+                        Function::ScopeChanged(scope);
                         return entry;
                     }
                     else
@@ -497,6 +664,7 @@ Rewrite *Context::Enter(Infix *rewrite, bool overwrite)
         else
             parent = &children->left;
         h = Rehash(h);
+        depth++;
     }
 
     // Return the entry we created
@@ -510,7 +678,8 @@ Tree *Context::Assign(Tree *ref, Tree *value)
 // ----------------------------------------------------------------------------
 {
     // Check if the reference already exists
-    Infix *decl = Reference(ref);
+    Scope_p scope;
+    Infix *decl = Reference(ref, &scope);
     if (!decl)
     {
         // The reference does not exist: we need to create it.
@@ -521,8 +690,8 @@ Tree *Context::Assign(Tree *ref, Tree *value)
 
         // If we have 'X:integer := 3', define 'X as integer'
         if (Infix *typed = ref->AsInfix())
-            if (typed->name == ":")
-                typed->name = "as";
+            if (typed->name == symColon)
+                typed->name = symAs;
 
         // Enter in the symbol table
         Define(ref, value);
@@ -532,7 +701,7 @@ Tree *Context::Assign(Tree *ref, Tree *value)
         // Check if the declaration has a type, i.e. it is 'X as integer'
         if (Infix *typeDecl = decl->left->AsInfix())
         {
-            if (typeDecl->name == "as")
+            if (typeDecl->name == symAs)
             {
                 Tree *type = typeDecl->right;
                 Tree *castedValue = TypeCheck(this, type, value);
@@ -550,7 +719,11 @@ Tree *Context::Assign(Tree *ref, Tree *value)
         }
 
         // Update existing value in place
+        Tree_p old = decl->right;
         decl->right = value;
+
+        // Bytecode compiled against that scope may have used the old value
+        Function::ValueChanged(scope, decl, old);
     }
 
     // Return evaluated assigned value
@@ -624,6 +797,83 @@ text Context::ResolvePrefixedPath(text path)
 // 
 // ============================================================================
 
+static Tree *lookupInScope(Scope *symbols, Scope *scope, Tree *what, ulong h0,
+                           Context::lookup_fn lookup, void *info)
+// ----------------------------------------------------------------------------
+//   Try the declarations of a single scope whose hash matches
+// ----------------------------------------------------------------------------
+{
+    // Skip empty scopes, and scopes that don't define that hash
+    if (scope->right == eliot_nil || !ScopeFilter::MayContain(scope, h0))
+        return NULL;
+
+    // Large scopes have a hash table with the rewrites in trie order
+    if (ScopeTable *table = ScopeTable::For(scope))
+    {
+        uint generation = table->generation;
+        uint slot = table->Start(h0);
+        while (uint index = table->slots[slot])
+        {
+            if (table->entries[index-1].hash == h0)
+            {
+                Infix *decl = table->entries[index-1].decl;
+                Tree *result = lookup(symbols, scope, what, decl, info);
+                if (result)
+                    return result;
+
+                // If the lookup entered rewrites, the slots may move
+                if (table->generation != generation)
+                {
+                    generation = table->generation;
+                    slot = table->Find(h0, index);
+                }
+            }
+            slot = (slot + 1) & table->mask;
+        }
+        return NULL;
+    }
+
+    // Initialize local scope
+    Tree_p &locals = scope->right;
+    Tree_p *parent = &locals;
+    ulong h = h0;
+
+    while (true)
+    {
+        // If we have found a nil spot, we are done with current scope
+        if (*parent == eliot_nil)
+            break;
+
+        // This should be a rewrite entry, follow it
+        Rewrite *entry = (*parent)->AsInfix();
+        ELIOT_ASSERT(entry && entry->name == REWRITE_NAME);
+        Infix *decl = RewriteDeclaration(entry);
+        ELIOT_ASSERT(!decl || decl->name == symArrow);
+        RewriteChildren *children = RewriteNext(entry);
+        ELIOT_ASSERT(children && children->name == REWRITE_CHILDREN_NAME);
+
+        // Check that hash matches
+        Tree *defined = RewriteDefined(decl->left);
+        ulong declHash = Context::Hash(defined);
+        if (declHash == h0)
+        {
+            Tree *result = lookup(symbols, scope, what, decl, info);
+            if (result)
+                return result;
+        }
+
+        // Keep going in local symbol table
+        if (h & 1)
+            parent = &children->right;
+        else
+            parent = &children->left;
+        h = Context::Rehash(h);
+    }
+
+    return NULL;
+}
+
+
 Tree *Context::Lookup(Tree *what, lookup_fn lookup, void *info, bool recurse)
 // ----------------------------------------------------------------------------
 //   Lookup a tree using the given lookup function
@@ -638,44 +888,23 @@ Tree *Context::Lookup(Tree *what, lookup_fn lookup, void *info, bool recurse)
 
     while (scope)
     {
-        // Initialize local scope
-        Tree_p &locals = scope->right;
-        Tree_p *parent = &locals;
-        Tree *result = NULL;
-        ulong h = h0;
-
-        while (true)
+        // From global scopes outwards, the candidates are usually cached
+        if (recurse && LookupCache::Enabled(scope))
         {
-            // If we have found a nil spot, we are done with current scope
-            if (*parent == eliot_nil)
-                break;
-
-            // This should be a rewrite entry, follow it
-            Rewrite *entry = (*parent)->AsInfix();
-            ELIOT_ASSERT(entry && entry->name == REWRITE_NAME);
-            Infix *decl = RewriteDeclaration(entry);
-            ELIOT_ASSERT(!decl || decl->name == "->");
-            RewriteChildren *children = RewriteNext(entry);
-            ELIOT_ASSERT(children && children->name == REWRITE_CHILDREN_NAME);
-
-            // Check that hash matches
-            Tree *defined = RewriteDefined(decl->left);
-            ulong declHash = Hash(defined);
-            if (declHash == h0)
-            {
-                result = lookup(symbols, scope, what, decl, info);
-                if (result)
-                    return result;
-            }
-
-            // Keep going in local symbol table
-            if (h & 1)
-                parent = &children->right;
-            else
-                parent = &children->left;
-            h = Rehash(h);
+            if (dependencies)
+                for (Scope *s = scope; s; s = ScopeParent(s))
+                    dependencies->insert(Dependency(s, h0));
+            return LookupCache::Lookup(symbols, scope, what, h0, lookup, info);
         }
 
+        // Code being compiled depends on what this scope defines for h0
+        if (dependencies)
+            dependencies->insert(Dependency(scope, h0));
+
+        Tree *result = lookupInScope(symbols, scope, what, h0, lookup, info);
+        if (result)
+            return result;
+
         // Not found in this scope. Keep going with next scope if recursing
         // The last top-level global will be nil, so we will end with scope=NULL
         if (!recurse)
@@ -688,21 +917,297 @@ Tree *Context::Lookup(Tree *what, lookup_fn lookup, void *info, bool recurse)
 }
 
 
-static Tree *findReference(Scope *, Scope *, Tree *what, Infix *decl, void *)
+ScopeTable *ScopeTable::For(Scope *scope)
+// ----------------------------------------------------------------------------
+//   Return the hash table for a scope if it has one that is up to date
+// ----------------------------------------------------------------------------
+{
+    ScopeTable *table = scope->GetInfo<ScopeTable>();
+    if (table && table->rewrites != scope->right)
+        return NULL;
+    return table;
+}
+
+
+void ScopeTable::Build(Scope *scope)
+// ----------------------------------------------------------------------------
+//   Build the hash table of a scope from its trie
+// ----------------------------------------------------------------------------
+//   Rewrites with the same hash are on the same path in the trie, with
+//   the earliest first, so a preorder walk enters them in the right order.
+{
+    ScopeTable *table = scope->GetInfo<ScopeTable>();
+    if (!table)
+    {
+        table = new ScopeTable(scope->right);
+        scope->SetInfo<ScopeTable>(table);
+    }
+    table->rewrites = scope->right;
+    table->entries.clear();
+    table->slots.assign(MIN_SLOTS, 0);
+    table->mask = MIN_SLOTS - 1;
+    table->generation++;
+
+    std::vector<Rewrite *> pending;
+    if (Rewrite *root = ScopeRewrites(scope))
+        pending.push_back(root);
+    while (pending.size())
+    {
+        Rewrite *entry = pending.back();
+        pending.pop_back();
+        Infix *decl = RewriteDeclaration(entry);
+        table->Add(Context::Hash(RewriteDefined(decl->left)), decl);
+
+        RewriteChildren *children = RewriteNext(entry);
+        if (Rewrite *right = children->right->AsInfix())
+            pending.push_back(right);
+        if (Rewrite *left = children->left->AsInfix())
+            pending.push_back(left);
+    }
+
+    IFTRACE(symbols)
+        std::cerr << "SCOPE TABLE " << (void *) scope
+                  << " " << table->entries.size() << " rewrites\n";
+}
+
+
+void ScopeTable::Add(ulong hash, Infix *decl)
+// ----------------------------------------------------------------------------
+//   Add a rewrite after all the existing ones, growing the table if needed
+// ----------------------------------------------------------------------------
+{
+    Entry entry = { hash, decl };
+    entries.push_back(entry);
+
+    uint count = entries.size();
+    if (2 * count <= slots.size())
+    {
+        Insert(hash, count);
+        return;
+    }
+
+    // Keep the load at most 1/2, reinsert entries in their original order
+    uint size = 2 * slots.size();
+    slots.assign(size, 0);
+    mask = size - 1;
+    generation++;
+    for (uint i = 0; i < count; i++)
+        Insert(entries[i].hash, i + 1);
+}
+
+
+void ScopeTable::Insert(ulong hash, uint index)
+// ----------------------------------------------------------------------------
+//   Put an entry in the first free slot starting at its hash
+// ----------------------------------------------------------------------------
+{
+    uint slot = Start(hash);
+    while (slots[slot])
+        slot = (slot + 1) & mask;
+    slots[slot] = index;
+}
+
+
+uint ScopeTable::Find(ulong hash, uint index)
+// ----------------------------------------------------------------------------
+//   Find the slot holding a given entry
+// ----------------------------------------------------------------------------
+{
+    uint slot = Start(hash);
+    while (slots[slot] != index)
+    {
+        ELIOT_ASSERT(slots[slot] && "Entry missing from scope table");
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+
+// ============================================================================
+//
+//    Cache of the candidates found from global scopes outwards
+//
+// ============================================================================
+
+LookupCache::Entry *LookupCache::entries = NULL;
+ulong               LookupCache::serials = 0;
+ulong               LookupCache::hits    = 0;
+ulong               LookupCache::misses  = 0;
+ulong               LookupCache::stale   = 0;
+
+
+void LookupCache::Enable(Scope *scope)
+// ----------------------------------------------------------------------------
+//   Cache the lookups starting from the given scope
+// ----------------------------------------------------------------------------
+{
+    if (!scope->GetInfo<LookupEpoch>())
+        scope->SetInfo<LookupEpoch>(new LookupEpoch);
+}
+
+
+bool LookupCache::Enabled(Scope *scope)
+// ----------------------------------------------------------------------------
+//   Check if lookups from that scope are cached
+// ----------------------------------------------------------------------------
+{
+    return (Info *) scope->info && scope->GetInfo<LookupEpoch>();
+}
+
+
+void LookupCache::ScopeChanged(Scope *scope)
+// ----------------------------------------------------------------------------
+//   Invalidate the entries built from a scope whose rewrites changed
+// ----------------------------------------------------------------------------
+{
+    if ((Info *) scope->info)
+    {
+        if (LookupEpoch *info = scope->GetInfo<LookupEpoch>())
+        {
+            info->epoch++;
+            IFTRACE(symbols)
+                std::cerr << "LOOKUP CACHE scope " << (void *) scope
+                          << " epoch " << info->epoch << "\n";
+        }
+    }
+}
+
+
+static Tree *collectCandidate(Scope *, Scope *scope,
+                              Tree *, Infix *decl, void *info)
+// ----------------------------------------------------------------------------
+//   Record a candidate while filling a cache entry
+// ----------------------------------------------------------------------------
+{
+    LookupCache::Candidates *candidates = (LookupCache::Candidates *) info;
+    LookupCache::Candidate candidate = { scope, decl };
+    candidates->push_back(candidate);
+    return NULL;
+}
+
+
+Tree *LookupCache::Lookup(Scope *symbols, Scope *scope,
+                          Tree *what, ulong hash,
+                          Context::lookup_fn lookup, void *info)
+// ----------------------------------------------------------------------------
+//   Try the cached candidates for a form from the given scope outwards
+// ----------------------------------------------------------------------------
+{
+    Entry *entry = Find(scope, hash);
+    ulong serial = entry->serial;
+    for (uint i = 0; i < entry->candidates.size(); i++)
+    {
+        Candidate candidate = entry->candidates[i];
+        Tree *result = lookup(symbols, candidate.scope, what,
+                              candidate.decl, info);
+        if (result)
+            return result;
+
+        // A nested lookup may have rebuilt or replaced the entry
+        if (entry->serial != serial)
+        {
+            entry = Find(scope, hash);
+            serial = entry->serial;
+        }
+    }
+    return NULL;
+}
+
+
+LookupCache::Entry *LookupCache::Find(Scope *scope, ulong hash)
+// ----------------------------------------------------------------------------
+//   Return the entry for a scope and hash, rebuilding it if necessary
+// ----------------------------------------------------------------------------
+{
+    if (!entries)
+        entries = new Entry[SIZE];
+
+    ulong  key = hash ^ ((ulong) scope >> 4);
+    Entry *entry = &entries[(key ^ (key >> 16)) & (SIZE-1)];
+    if (entry->scope == scope && entry->hash == hash)
+    {
+        if (Valid(entry))
+        {
+            hits++;
+            return entry;
+        }
+        stale++;
+    }
+    misses++;
+    Fill(entry, scope, hash);
+    return entry;
+}
+
+
+bool LookupCache::Valid(Entry *entry)
+// ----------------------------------------------------------------------------
+//   Check that none of the scopes the entry was built from changed
+// ----------------------------------------------------------------------------
+{
+    for (Stamps::iterator s = entry->stamps.begin();
+         s != entry->stamps.end();
+         s++)
+        if ((*s).info->epoch != (*s).epoch)
+            return false;
+    return true;
+}
+
+
+void LookupCache::Fill(Entry *entry, Scope *scope, ulong hash)
+// ----------------------------------------------------------------------------
+//   Collect the candidates in lookup order and the epoch of their scopes
+// ----------------------------------------------------------------------------
+{
+    entry->scope = scope;
+    entry->hash = hash;
+    entry->serial = ++serials;
+    entry->candidates.clear();
+    entry->stamps.clear();
+
+    for (Scope *s = scope; s; s = ScopeParent(s))
+    {
+        LookupEpoch *info = s->GetInfo<LookupEpoch>();
+        if (!info)
+        {
+            info = new LookupEpoch;
+            s->SetInfo<LookupEpoch>(info);
+        }
+        Stamp stamp = { info, info->epoch };
+        entry->stamps.push_back(stamp);
+        lookupInScope(s, s, NULL, hash, collectCandidate, &entry->candidates);
+    }
+}
+
+
+void LookupCache::PrintStatistics()
 // ----------------------------------------------------------------------------
-//   Return the reference we found
+//   Print the hit rate, in the same format as the GC statistics
 // ----------------------------------------------------------------------------
 {
+    ulong total = hits + misses;
+    printf("%24s %8lu hits %8lu misses %8lu stale %3lu%%\n", "Lookup cache",
+           hits, misses, stale, total ? hits * 100 / total : 0);
+}
+
+
+static Tree *findReference(Scope *, Scope *scope,
+                           Tree *what, Infix *decl, void *info)
+// ----------------------------------------------------------------------------
+//   Return the reference we found, and optionally its scope
+// ----------------------------------------------------------------------------
+{
+    if (info)
+        *((Scope_p *) info) = scope;
     return decl;
 }
 
 
-Infix *Context::Reference(Tree *form)
+Infix *Context::Reference(Tree *form, Scope_p *scope)
 // ----------------------------------------------------------------------------
 //   Find an existing definition in the symbol table that matches the form
 // ----------------------------------------------------------------------------
 {
-    Tree *result = Lookup(form, findReference, NULL, true);
+    Tree *result = Lookup(form, findReference, scope, true);
     if (result)
         if (Infix *decl = result->AsInfix())
             return decl;
@@ -791,7 +1296,7 @@ static ulong listNames(Rewrite *where, text begin, RewriteList &list, bool pfx)
     while (where)
     {
         Infix *decl = RewriteDeclaration(where);
-        if (decl && decl->name == "->")
+        if (decl && decl->name == symArrow)
         {
             Tree *declared = decl->left;
             Name *name = declared->AsName();
@@ -807,7 +1312,7 @@ static ulong listNames(Rewrite *where, text begin, RewriteList &list, bool pfx)
                 count++;
             }
         }
-        if (where->name == ";" || where->name == "\n")
+        if (where->name == symSequence || where->name == symNewline)
             count += listNames(where->left->AsInfix(), begin, list, pfx);
         where = decl->right->AsInfix();
     }
@@ -843,22 +1348,6 @@ ulong Context::ListNames(text begin, RewriteList &list,
 // 
 // ============================================================================
 
-static inline ulong HashText(const text &t)
-// ----------------------------------------------------------------------------
-//   Compute the has for some text
-// ----------------------------------------------------------------------------
-{
-    ulong h = 0;
-    uint  l = t.length();
-    kstring ptr = t.data();
-    if (l > 8)
-        l = 8;
-    for (uint i = 0; i < l; i++)
-        h = (h * 0x301) ^ *ptr++;
-    return h;
-}
-    
-
 ulong Context::Hash(Tree *what)
 // ----------------------------------------------------------------------------
 //   Compute the hash code in the rewrite table
@@ -879,24 +1368,24 @@ ulong Context::Hash(Tree *what)
         }
         break;
     case TEXT:
-        h += HashText(((Text *) what)->value);
+        h += ((Text *) what)->hash;
         break;
     case NAME:
-        h += HashText(((Name *) what)->value);
+        h += ((Name *) what)->value.Hash();
         break;
     case BLOCK:
-        h += HashText(((Block *) what)->opening);
+        h += TextHash(((Block *) what)->opening);
         break;
     case INFIX:
-        h += HashText(((Infix *) what)->name);
+        h += ((Infix *) what)->name.Hash();
         break;
     case PREFIX:
         if (Name *name = ((Prefix *) what)->left->AsName())
-            h += HashText(name->value);
+            h += name->value.Hash();
         break;
     case POSTFIX:
         if (Name *name = ((Postfix *) what)->right->AsName())
-            h += HashText(name->value);
+            h += name->value.Hash();
         break;
     }
 
@@ -917,6 +1406,45 @@ void Context::Clear()
 // ----------------------------------------------------------------------------
 {
     symbols->right = eliot_nil;
+    symbols->Purge<ScopeTable>();
+    if (ScopeFilter *filter = symbols->GetInfo<ScopeFilter>())
+        filter->bits = 0;
+    LookupCache::ScopeChanged(symbols);
+}
+
+
+void Context::Invalidate(Scope *scope, ulong hash)
+// ----------------------------------------------------------------------------
+//   Drop compiled code whose lookups may find a new declaration
+// ----------------------------------------------------------------------------
+//   Code only depends on the declarations it looked up. A declaration for
+//   another hash, or in a scope the lookups did not go through, leaves
+//   the code valid.
+{
+    if (compiled.empty())
+        return;
+
+    Dependency dependency(scope, hash);
+    uint dropped = 0;
+    uint total = compiled.size();
+    code_map::iterator i = compiled.begin();
+    while (i != compiled.end())
+    {
+        code_map::iterator next = i;
+        next++;
+        if ((*i).second.uses.count(dependency))
+        {
+            compiled.erase(i);
+            dropped++;
+        }
+        i = next;
+    }
+
+    IFTRACE(compile)
+        if (dropped)
+            std::cerr << "INVALIDATE " << dropped << " of " << total
+                      << " compiled in scope " << (void *) scope
+                      << " for hash " << hash << "\n";
 }
 
 
@@ -954,7 +1482,7 @@ void Context::Dump(std::ostream &out, Rewrite *rw)
 
         if (decl)
         {
-            if (decl->name == "->")
+            if (decl->name == symArrow)
                 out << decl->left << " -> "
                     << ShortTreeForm(decl->right) << "\n";
             else
@@ -190,7 +190,19 @@ typedef GCPtr<Context>                  Context_p;
 typedef std::vector<Infix_p>            RewriteList;
 typedef std::map<Tree_p, Tree_p>        TreeMap;
 typedef Tree *                          (*eval_fn) (Scope *, Tree *);
-typedef std::map<Tree_p, eval_fn>       code_map;
+typedef std::pair<Scope *, ulong>       Dependency;
+typedef std::set<Dependency>          Dependencies;
+
+struct CompiledCode
+// ----------------------------------------------------------------------------
+//   Machine code for a tree, with the (scope, hash) lookups it depends on
+// ----------------------------------------------------------------------------
+{
+    CompiledCode(): code(NULL), uses() {}
+    eval_fn             code;
+    Dependencies        uses;
+};
+typedef std::map<Tree_p, CompiledCode>  code_map;
 
 
 
@@ -238,6 +250,7 @@ public:
     // Compile and evaluate a tree in the current context
     eval_fn             Compile(Tree *what);
     Tree *              Evaluate(Tree *what);
+    Tree *              EvaluateAdaptive(Tree *what);
 
     // Special forms of evaluation
     Tree *              Call(text prefix, TreeList &args);
@@ -272,7 +285,7 @@ public:
     Tree *              Lookup(Tree *what,
                                lookup_fn lookup, void *info,
                                bool recurse=true);
-    Rewrite *           Reference(Tree *form);
+    Rewrite *           Reference(Tree *form, Scope_p *scope = NULL);
     Tree *              Bound(Tree *form,bool recurse=true);
     Tree *              Bound(Tree *form, bool rec, Rewrite_p *rw,Scope_p *ctx);
     Tree *              Named(text name, bool recurse=true);
@@ -292,6 +305,9 @@ public:
     // Clear the symbol table
     void                Clear();
 
+    // Drop compiled code that looked up a given hash in a given scope
+    void                Invalidate(Scope *scope, ulong hash);
+
     // Dump symbol tables
     static void         Dump(std::ostream &out, Scope *symbols);
     static void         Dump(std::ostream &out, Rewrite *locals);
@@ -301,10 +317,201 @@ public:
     Scope_p             symbols;
     code_map            compiled;
     static uint         hasRewritesForKind;
+    static Dependencies*dependencies;   // Lookups recorded while compiling
     GARBAGE_COLLECT(Context);
 };
 
 
+struct ScopeFilter : Info
+// ----------------------------------------------------------------------------
+//   Bloom filter of the hashes of the rewrites entered in a scope
+// ----------------------------------------------------------------------------
+//   Most scopes on a lookup path are tiny, e.g. the bindings of a single
+//   lazy argument. Context::Enter sets two bits per rewrite hash, which
+//   also depends on the kind of the form, and Context::Lookup skips the
+//   scopes where one of the bits for the form is clear without walking
+//   their trie. Scopes without a filter, e.g. deserialized ones, are
+//   always walked.
+{
+    ScopeFilter(): bits(0) {}
+
+    static ulonglong    Bits(ulong hash)
+    {
+        return (1ULL << (hash & 63)) | (1ULL << ((hash >> 6) & 63));
+    }
+    void                Add(ulong hash)         { bits |= Bits(hash); }
+    bool                MayContain(ulong hash)
+    {
+        ulonglong mask = Bits(hash);
+        return (bits & mask) == mask;
+    }
+    static bool         MayContain(Scope *scope, ulong hash)
+    {
+        ScopeFilter *filter = scope->GetInfo<ScopeFilter>();
+        return !filter || filter->MayContain(hash);
+    }
+
+public:
+    ulonglong           bits;
+};
+
+
+struct ScopeTable : Info
+// ----------------------------------------------------------------------------
+//   Open-addressing hash table indexing the rewrites of a large scope
+// ----------------------------------------------------------------------------
+//   The rewrites of a scope are stored in a binary trie of Infix nodes,
+//   which is what Dump and serialization see. Following the trie visits a
+//   GC pointer and recomputes a hash per entry. Once the trie gets deeper
+//   than MIN_DEPTH, a table attached to the scope records the hash and
+//   declaration of each rewrite contiguously, in the order they were
+//   entered. Slots use linear probing, so candidates with the same hash
+//   are found in the order the trie would find them.
+{
+    enum { MIN_DEPTH = 8, MIN_SLOTS = 32 };
+
+    struct Entry
+    {
+        ulong           hash;
+        Infix *         decl;           // Kept alive by the trie
+    };
+    typedef std::vector<Entry>  Entries;
+    typedef std::vector<uint>   Slots;  // Index in entries + 1, 0 if free
+
+    ScopeTable(Tree *rewrites)
+        : rewrites(rewrites), entries(), slots(MIN_SLOTS), mask(MIN_SLOTS-1),
+          generation(0) {}
+
+    void                Add(ulong hash, Infix *decl);
+    uint                Find(ulong hash, uint index);
+    uint                Start(ulong hash)  { return (hash ^ (hash>>16)) & mask; }
+    static ScopeTable * For(Scope *scope);
+    static void         Build(Scope *scope);
+
+private:
+    void                Insert(ulong hash, uint index);
+
+public:
+    Tree *              rewrites;       // Trie root the table was built for
+    Entries             entries;
+    Slots               slots;
+    uint                mask;
+    uint                generation;     // Changes when slots are rebuilt
+};
+
+
+struct LookupEpoch : Info
+// ----------------------------------------------------------------------------
+//   Mark scopes whose lookups are cached, counting changes to their rewrites
+// ----------------------------------------------------------------------------
+{
+    LookupEpoch(): epoch(0) {}
+    ulong               epoch;
+};
+
+
+struct LookupCache
+// ----------------------------------------------------------------------------
+//   Declarations matching a form hash, from a given scope outwards
+// ----------------------------------------------------------------------------
+//   Evaluating a name walks every enclosing scope, while the declarations
+//   it finds in the global scopes almost never change. Scopes marked with
+//   a LookupEpoch, e.g. those of source files, remember in a global table
+//   the candidates found from them outwards, in lookup order. Each entry
+//   records the epoch of the scopes it was built from, and is rebuilt once
+//   any of them changes. Assigning an existing variable only changes a
+//   value, which the lookup functions read from the declaration.
+{
+    enum { SIZE = 1024 };
+
+    struct Candidate
+    {
+        Scope *         scope;
+        Infix *         decl;           // Kept alive by the scope
+    };
+    struct Stamp
+    {
+        LookupEpoch *   info;
+        ulong           epoch;
+    };
+    typedef std::vector<Candidate>      Candidates;
+    typedef std::vector<Stamp>          Stamps;
+
+    struct Entry
+    {
+        Entry(): scope(), hash(0), serial(0) {}
+        Scope_p         scope;
+        ulong           hash;
+        ulong           serial;         // Changes when the entry is rebuilt
+        Candidates      candidates;
+        Stamps          stamps;
+    };
+
+    static void         Enable(Scope *scope);
+    static bool         Enabled(Scope *scope);
+    static void         ScopeChanged(Scope *scope);
+    static Tree *       Lookup(Scope *symbols, Scope *scope,
+                               Tree *what, ulong hash,
+                               Context::lookup_fn lookup, void *info);
+    static void         PrintStatistics();
+
+private:
+    static Entry *      Find(Scope *scope, ulong hash);
+    static bool         Valid(Entry *entry);
+    static void         Fill(Entry *entry, Scope *scope, ulong hash);
+
+    static Entry *      entries;
+    static ulong        serials;
+
+public:
+    static ulong        hits;
+    static ulong        misses;
+    static ulong        stale;
+};
+
+
+struct PooledContext
+// ----------------------------------------------------------------------------
+//   A context borrowed for the duration of a candidate lookup
+// ----------------------------------------------------------------------------
+//   Most candidates tried for an overloaded name fail to match. Instead of
+//   allocating a Context and a Scope for each of them, lookups borrow them
+//   from a pool, and give them back when the PooledContext is destroyed.
+//   Pooled objects must be released in reverse order of acquisition.
+//   If they are still referenced at that point, e.g. from a closure, they
+//   escaped and are left to the garbage collector. Keep() does the same
+//   for callers that may retain raw pointers to the scope.
+{
+    PooledContext(Scope *scope, bool createScope = false);
+    ~PooledContext();
+
+    Context *           operator->()    { return context; }
+    operator            Context *()     { return context; }
+    void                Keep()          { keep = true; }
+
+private:
+    struct Entry
+    {
+        Context_p       context;
+        Scope_p         scope;
+    };
+    typedef std::vector<Entry> Entries;
+
+    Context *           context;
+    Scope *             scope;
+    uint                index;
+    bool                keep;
+
+    static Entries *    pool;
+    static uint         used;
+
+public:
+    static ulong        reused;
+    static ulong        escaped;
+};
+
+
+
 // ============================================================================
 // 
 //    Meaning adapters - Make it more explicit what happens in code
@@ -67,19 +67,27 @@ void *TypeAllocator::highestAddress = (void *) 0;
 void *TypeAllocator::lowestAllocatorAddress = (void *) ~0;
 void *TypeAllocator::highestAllocatorAddress = (void *) 0;
 Atomic<uint> TypeAllocator::finalizing = 0;
+bool TypeAllocator::deferred = false;
 
 // Identifier of the thread currently collecting if any
 #define PTHREAD_NULL ((pthread_t) 0)
 static pthread_t collecting = PTHREAD_NULL;
 
+// Free chunks cached by the current thread, indexed by allocator
+typedef std::vector<TypeAllocator::ThreadCache> ThreadCaches;
+static __thread ThreadCaches *threadCaches = NULL;
+static pthread_key_t          threadCachesKey;
+static pthread_once_t         threadCachesOnce = PTHREAD_ONCE_INIT;
+
 
 TypeAllocator::TypeAllocator(kstring tn, uint os)
 // ----------------------------------------------------------------------------
 //    Setup an empty allocator
 // ----------------------------------------------------------------------------
-    : gc(NULL), name(tn), locked(0), lowestInUse(~0UL), highestInUse(0),
+    : gc(NULL), name(tn), index(0),
+      locked(0), lowestInUse(~0UL), highestInUse(0),
       chunks(), freeList(NULL), toDelete(NULL),
-      available(0), freedCount(0),
+      available(0), freedCount(0), refillCount(0), returnCount(0),
       chunkSize(1022), objectSize(os), alignedSize(os),
       allocatedCount(0), scannedCount(0), collectedCount(0), totalCount(0)
 {
@@ -95,6 +103,10 @@ TypeAllocator::TypeAllocator(kstring tn, uint os)
         alignedSize = totalSize - sizeof(Chunk);
     }
 
+    // Free chunks link batches in the object itself
+    if (alignedSize < sizeof(Chunk_vp))
+        alignedSize = sizeof(Chunk_vp);
+
     // Use the address of the garbage collector as signature
     gc = GarbageCollector::GC();
 
@@ -134,7 +146,116 @@ void *TypeAllocator::Allocate()
 //   Allocate a chunk of the given size
 // ----------------------------------------------------------------------------
 {
-    RECORD(MEMORY_DETAILS, "Allocate", "free", (intptr_t) freeList.Get());
+    ThreadCache &cache = LocalCache();
+    RECORD(MEMORY_DETAILS, "Allocate", "free", (intptr_t) cache.free);
+
+    Chunk_vp result = cache.free;
+    if (!result)
+        result = Refill(cache);
+    cache.free = result->next;
+    cache.count--;
+
+    VALGRIND_MAKE_MEM_UNDEFINED(result, sizeof(Chunk));
+    result->allocator = this;
+    result->bits |= IN_USE;     // Mark it as in use for current collection
+    result->count = 0;
+    UpdateInUseRange(result);
+    allocatedCount++;
+
+    void *ret =  (void *) &result[1];
+    VALGRIND_MEMPOOL_ALLOC(this, ret, objectSize);
+    return ret;
+}
+
+
+void TypeAllocator::Delete(void *ptr)
+// ----------------------------------------------------------------------------
+//   Free a chunk of the given size
+// ----------------------------------------------------------------------------
+{
+    RECORD(MEMORY_DETAILS, "Delete", "ptr", (intptr_t) ptr);
+
+    if (!ptr)
+        return;
+
+    Chunk_vp chunk = (Chunk_vp) ptr - 1;
+    ELIOT_ASSERT(IsGarbageCollected(ptr) &&
+                 "Deleted pointer not managed by GC");
+    ELIOT_ASSERT(IsAllocated(ptr) &&
+                 "Deleted GC pointer that was already freed");
+    ELIOT_ASSERT(!chunk->count &&
+                 "Deleted pointer has live references");
+
+#ifdef DEBUG
+    // Scrub all the pointers
+    uint32 *base = (uint32 *) ptr;
+    uint32 *last = (uint32 *) (((char *) ptr) + alignedSize);
+    VALGRIND_MAKE_MEM_UNDEFINED(ptr, alignedSize);
+    for (uint *p = base; p < last; p++)
+        *p = 0xDeadBeef;
+#endif
+
+    VALGRIND_MEMPOOL_FREE(this, ptr);
+
+    // Put the pointer back in the cache of the current thread
+    ThreadCache &cache = LocalCache();
+    chunk->next = cache.free;
+    cache.free = chunk;
+    cache.count++;
+    freedCount++;
+
+    // Return the oldest chunks to the shared list if we hold too many
+    if (cache.count >= 2 * BATCH_SIZE)
+        Flush(cache, BATCH_SIZE);
+}
+
+
+static void releaseThreadCaches(void *caches)
+// ----------------------------------------------------------------------------
+//   Return the chunks cached by a thread that exits
+// ----------------------------------------------------------------------------
+{
+    threadCaches = (ThreadCaches *) caches;
+    TypeAllocator::ReleaseThreadCaches();
+}
+
+
+static void createThreadCachesKey()
+// ----------------------------------------------------------------------------
+//   Create the key used to release thread caches on thread exit
+// ----------------------------------------------------------------------------
+{
+    pthread_key_create(&threadCachesKey, releaseThreadCaches);
+}
+
+
+TypeAllocator::ThreadCache &TypeAllocator::LocalCache()
+// ----------------------------------------------------------------------------
+//   Return the cache of free chunks for this allocator in current thread
+// ----------------------------------------------------------------------------
+{
+    ThreadCaches *caches = threadCaches;
+    if (!caches)
+    {
+        pthread_once(&threadCachesOnce, createThreadCachesKey);
+        caches = threadCaches = new ThreadCaches;
+        pthread_setspecific(threadCachesKey, caches);
+    }
+    if (index >= caches->size())
+    {
+        ThreadCache empty = { NULL, 0 };
+        caches->resize(gc->allocators.size(), empty);
+    }
+    return (*caches)[index];
+}
+
+
+TypeAllocator::Chunk_vp TypeAllocator::Refill(ThreadCache &cache)
+// ----------------------------------------------------------------------------
+//   Take a batch of chunks from the shared free list, allocating if empty
+// ----------------------------------------------------------------------------
+{
+    RECORD(MEMORY_DETAILS, "Refill", "free", (intptr_t) freeList.Get());
 
     Chunk_vp result;
     do
@@ -150,7 +271,7 @@ void *TypeAllocator::Allocate()
                 result = freeList;
                 continue;
             }
-        
+
             // Nothing free: allocate a big enough chunk
             size_t  itemSize  = alignedSize + sizeof(Chunk);
             size_t  allocSize = (chunkSize + 1) * itemSize;
@@ -160,15 +281,29 @@ void *TypeAllocator::Allocate()
 
             RECORD(MEMORY_DETAILS, "New Chunk", "addr", (intptr_t) allocated);
 
+            // Link the items in batches, the first batch ends the list
             char *chunkBase = (char *) allocated + alignedSize;
-            Chunk_vp last = (Chunk_vp) chunkBase;
-            Chunk_vp free = result;
-            for (uint i = 0; i < chunkSize; i++)
+            Chunk_vp last = NULL;
+            Chunk_vp free = NULL;
+            for (uint i = 0; i < chunkSize; i += BATCH_SIZE)
             {
-                Chunk_vp ptr = (Chunk_vp) (chunkBase + i * itemSize);
-                VALGRIND_MAKE_MEM_UNDEFINED(&ptr->next,sizeof(ptr->next));
-                ptr->next = free;
-                free = ptr;
+                uint     count = chunkSize - i;
+                Chunk_vp batch = NULL;
+                if (count > BATCH_SIZE)
+                    count = BATCH_SIZE;
+                for (uint j = 0; j < count; j++)
+                {
+                    Chunk_vp ptr = (Chunk_vp) (chunkBase + (i+j) * itemSize);
+                    VALGRIND_MAKE_MEM_UNDEFINED(ptr, sizeof(Chunk));
+                    ptr->next = batch;
+                    batch = ptr;
+                }
+                VALGRIND_MAKE_MEM_UNDEFINED(batch + 1, sizeof(Chunk_vp));
+                batch->count = count;
+                NextBatch(batch) = free;
+                free = batch;
+                if (!last)
+                    last = batch;
             }
 
             // Update the chunks list
@@ -184,7 +319,7 @@ void *TypeAllocator::Allocate()
             while (!freeList.SetQ(result, free))
             {
                 result = freeList;
-                last->next = result;
+                NextBatch(last) = result;
             }
 
             // Unlock the chunks
@@ -194,60 +329,92 @@ void *TypeAllocator::Allocate()
             result = freeList;
         }
     }
-    while (!freeList.SetQ(result, result->next));
+    while (!freeList.SetQ(result, NextBatch(result)));
 
-    VALGRIND_MAKE_MEM_UNDEFINED(result, sizeof(Chunk));
-    result->allocator = this;
-    result->bits |= IN_USE;     // Mark it as in use for current collection
-    result->count = 0;
-    UpdateInUseRange(result);
-    allocatedCount++;
-    if (--available < chunkSize * 0.9)
+    cache.free = result;
+    cache.count += result->count;
+    refillCount++;
+    available -= result->count;
+    if (available < chunkSize * 0.9)
         gc->MustRun();
-
-    void *ret =  (void *) &result[1];
-    VALGRIND_MEMPOOL_ALLOC(this, ret, objectSize);
-    return ret;
+    return result;
 }
 
 
-void TypeAllocator::Delete(void *ptr)
+void TypeAllocator::Flush(ThreadCache &cache, uint keep)
 // ----------------------------------------------------------------------------
-//   Free a chunk of the given size
+//   Return all but the 'keep' most recently freed chunks to the shared list
 // ----------------------------------------------------------------------------
 {
-    RECORD(MEMORY_DETAILS, "Delete", "ptr", (intptr_t) ptr);
-
-    if (!ptr)
+    if (cache.count <= keep)
         return;
 
-    Chunk_vp chunk = (Chunk_vp) ptr - 1;
-    ELIOT_ASSERT(IsGarbageCollected(ptr) &&
-                 "Deleted pointer not managed by GC");
-    ELIOT_ASSERT(IsAllocated(ptr) &&
-                 "Deleted GC pointer that was already freed");
-    ELIOT_ASSERT(!chunk->count &&
-                 "Deleted pointer has live references");
+    Chunk_vp rest = cache.free;
+    Chunk_vp last = NULL;
+    for (uint i = 0; i < keep; i++)
+    {
+        last = rest;
+        rest = rest->next;
+    }
+    if (last)
+        last->next = NULL;
+    else
+        cache.free = NULL;
+    cache.count = keep;
+
+    while (rest)
+    {
+        Chunk_vp batch = rest;
+        Chunk_vp tail = batch;
+        uint     count = 1;
+        while (count < BATCH_SIZE && tail->next)
+        {
+            tail = tail->next;
+            count++;
+        }
+        rest = tail->next;
+        tail->next = NULL;
+        PushBatch(batch, count);
+    }
+}
+
 
-    // Put the pointer back on the free list
+void TypeAllocator::PushBatch(Chunk_vp batch, uint count)
+// ----------------------------------------------------------------------------
+//   Put a batch of free chunks on the shared free list
+// ----------------------------------------------------------------------------
+{
+    RECORD(MEMORY_DETAILS, "Return batch", "count", count);
+
+    VALGRIND_MAKE_MEM_UNDEFINED(batch + 1, sizeof(Chunk_vp));
+    batch->count = count;
     do
     {
-        chunk->next = freeList;
+        NextBatch(batch) = freeList;
     }
-    while (!freeList.SetQ(chunk->next, chunk));
-    available++;
-    freedCount++;
+    while (!freeList.SetQ(NextBatch(batch), batch));
+    available += count;
+    returnCount++;
+}
 
-#ifdef DEBUG
-    // Scrub all the pointers
-    uint32 *base = (uint32 *) ptr;
-    uint32 *last = (uint32 *) (((char *) ptr) + alignedSize);
-    VALGRIND_MAKE_MEM_UNDEFINED(ptr, alignedSize);
-    for (uint *p = base; p < last; p++)
-        *p = 0xDeadBeef;
-#endif
 
-    VALGRIND_MEMPOOL_FREE(this, ptr);
+void TypeAllocator::ReleaseThreadCaches()
+// ----------------------------------------------------------------------------
+//   Return all the chunks cached by the current thread
+// ----------------------------------------------------------------------------
+{
+    ThreadCaches *caches = threadCaches;
+    if (!caches)
+        return;
+
+    GarbageCollector *gc = GarbageCollector::GC();
+    if (gc)
+        for (uint i = 0; i < caches->size(); i++)
+            gc->allocators[i]->Flush((*caches)[i], 0);
+
+    delete caches;
+    threadCaches = NULL;
+    pthread_setspecific(threadCachesKey, NULL);
 }
 
 
@@ -280,6 +447,12 @@ void TypeAllocator::ScheduleDelete(TypeAllocator::Chunk_vp ptr)
             // Put it on the to-delete list to avoid deep recursion
             LinkedListInsert(allocator->toDelete, ptr);
         }
+        else if (deferred)
+        {
+            // Uncounted references may remain: let the collector decide
+            Atomic<uintptr_t>::Or(ptr->bits, IN_USE);
+            UpdateInUseRange(ptr);
+        }
         else
         {
             // Delete current object immediately
@@ -373,6 +546,8 @@ void TypeAllocator::ResetStatistics()
 // ----------------------------------------------------------------------------
 {
     freedCount -= freedCount;
+    refillCount -= refillCount;
+    returnCount -= returnCount;
     allocatedCount = 0;
     scannedCount = 0;
     collectedCount = 0;
@@ -452,6 +627,7 @@ GarbageCollector::~GarbageCollector()
     MustRun();
     Collect();
     Collect();
+    TypeAllocator::ReleaseThreadCaches();
 
     Allocators::iterator i;
     for (i = allocators.begin(); i != allocators.end(); i++)
@@ -471,10 +647,20 @@ void GarbageCollector::Register(TypeAllocator *allocator)
 //    Record each individual allocator
 // ----------------------------------------------------------------------------
 {
+    allocator->index = allocators.size();
     allocators.push_back(allocator);
 }
 
 
+void GarbageCollector::AddRoots(Roots *roots)
+// ----------------------------------------------------------------------------
+//    Record references the collector must count before collecting
+// ----------------------------------------------------------------------------
+{
+    gc->roots.push_back(roots);
+}
+
+
 bool GarbageCollector::Sweep()
 // ----------------------------------------------------------------------------
 //    Cleanup all the pending deletions
@@ -514,6 +700,11 @@ bool GarbageCollector::Collect()
         for (l = listeners.begin(); l != listeners.end(); l++)
             (*l)->BeginCollection();
 
+        // Count uncounted references so that the collection keeps them
+        RootsList::iterator r;
+        for (r = roots.begin(); r != roots.end(); r++)
+            (*r)->Acquire();
+
         // Cleanup pending purges to maximize the effect of garbage collection
         bool sweeping = true;
         while (sweeping)
@@ -524,6 +715,10 @@ bool GarbageCollector::Collect()
             sweeping = Sweep();
         }
 
+        // Drop the root references, which marks unreferenced ones in use
+        for (r = roots.begin(); r != roots.end(); r++)
+            (*r)->Release();
+
         // Notify all the listeners that we completed the collection
         for (l = listeners.begin(); l != listeners.end(); l++)
             (*l)->EndCollection();
@@ -551,34 +746,46 @@ void GarbageCollector::PrintStatistics()
 // ----------------------------------------------------------------------------
 //    Print statistics about collection
 // ----------------------------------------------------------------------------
+//    REFILL and RETURN count the batches that thread caches took from and
+//    gave back to the shared free list, HIT% the allocations served from
+//    a thread cache without a refill.
 {
     uint tot = 0, alloc = 0, avail = 0, freed = 0, scan = 0, collect = 0;
-    printf("%24s %8s %8s %8s %8s %8s %8s\n",
-           "NAME", "TOTAL", "AVAIL", "ALLOC", "FREED", "SCANNED", "COLLECT");
+    uint allocs = 0, refills = 0;
+    printf("%24s %8s %8s %8s %8s %8s %8s %8s %8s %8s\n",
+           "NAME", "TOTAL", "AVAIL", "ALLOC", "FREED", "SCANNED", "COLLECT",
+           "REFILL", "RETURN", "HIT%");
 
     Allocators::iterator a;
     for (a = allocators.begin(); a != allocators.end(); a++)
     {
         TypeAllocator *ta = *a;
-        printf("%24s %8u %8u %8u %8u %8u %8u\n",
+        uint hits = ta->allocatedCount - ta->refillCount;
+        printf("%24s %8u %8u %8u %8u %8u %8u %8u %8u %7u%%\n",
                ta->name, ta->totalCount,
                ta->available.Get(), ta->allocatedCount,
-               ta->freedCount.Get(), ta->scannedCount, ta->collectedCount);
+               ta->freedCount.Get(), ta->scannedCount, ta->collectedCount,
+               ta->refillCount.Get(), ta->returnCount.Get(),
+               ta->allocatedCount ? hits * 100 / ta->allocatedCount : 0);
         tot     += ta->totalCount     * ta->alignedSize;
         alloc   += ta->allocatedCount * ta->alignedSize;
         avail   += ta->available      * ta->alignedSize;
         freed   += ta->freedCount     * ta->alignedSize;
         scan    += ta->scannedCount   * ta->alignedSize;
         collect += ta->collectedCount * ta->alignedSize;
+        allocs  += ta->allocatedCount;
+        refills += ta->refillCount;
 
         ta->ResetStatistics();            
     }
-    printf("%24s %8s %8s %8s %8s %8s %8s\n",
-           "=====", "=====", "=====", "=====", "=====", "=====", "=====");
-    printf("%24s %7uK %7uK %7uK %7uK %7uK %7uK\n",
+    printf("%24s %8s %8s %8s %8s %8s %8s %8s %8s %8s\n",
+           "=====", "=====", "=====", "=====", "=====", "=====", "=====",
+           "=====", "=====", "=====");
+    printf("%24s %7uK %7uK %7uK %7uK %7uK %7uK %8u %8s %7u%%\n",
            "Kilobytes",
            tot >> 10, avail >> 10, alloc >> 10,
-           freed >> 10, scan >> 10, collect >> 10);
+           freed >> 10, scan >> 10, collect >> 10,
+           refills, "", allocs ? (allocs - refills) * 100 / allocs : 0);
 }
 
 
@@ -707,16 +914,38 @@ void debuggc(void *ptr)
 
                     uint freeIndex = 0;
                     Chunk_vp prev = NULL;
-                    for (Chunk_vp f = alloc->freeList; f; f = f->next)
+                    for (Chunk_vp b = alloc->freeList; b; b = TA::NextBatch(b))
                     {
-                        freeIndex++;
-                        if (f == chunk)
+                        for (Chunk_vp f = b; f; f = f->next)
                         {
-                            std::cerr << " freelist #" << freeIndex
-                                      << " after " << prev << " ";
-                            found++;
+                            freeIndex++;
+                            if (f == chunk)
+                            {
+                                std::cerr << " freelist #" << freeIndex
+                                          << " after " << prev << " ";
+                                found++;
+                            }
+                            prev = f;
+                        }
+                    }
+
+                    freeIndex = 0;
+                    prev = NULL;
+                    ThreadCaches *caches = threadCaches;
+                    if (caches && alloc->index < caches->size())
+                    {
+                        TA::ThreadCache &cache = (*caches)[alloc->index];
+                        for (Chunk_vp f = cache.free; f; f = f->next)
+                        {
+                            freeIndex++;
+                            if (f == chunk)
+                            {
+                                std::cerr << " thread cache #" << freeIndex
+                                          << " after " << prev << " ";
+                                found++;
+                            }
+                            prev = f;
                         }
-                        prev = f;
                     }
 
                     freeIndex = 0;
@@ -56,6 +56,7 @@ ELIOT_BEGIN
 
 struct GarbageCollector;
 template <class Object, typename ValueType=void> struct GCPtr;
+template <class Object> struct FramePtr;
 
 
 
@@ -69,6 +70,9 @@ struct TypeAllocator
 // ----------------------------------------------------------------------------
 //   Structure allocating data for a single data type
 // ----------------------------------------------------------------------------
+//   Each thread allocates from and frees to its own cache of free chunks.
+//   The shared free list is a list of batches of up to BATCH_SIZE chunks,
+//   so that threads only synchronize once per batch.
 {
     struct Chunk
     {
@@ -83,6 +87,12 @@ struct TypeAllocator
     typedef volatile Chunk *Chunk_vp;
     typedef std::vector<Chunk_vp> Chunks;
 
+    struct ThreadCache
+    {
+        Chunk_vp            free;           // Free chunks owned by a thread
+        uint                count;          // Number of chunks in 'free'
+    };
+
 public:
     TypeAllocator(kstring name, uint objectSize);
     virtual ~TypeAllocator();
@@ -102,6 +112,8 @@ public:
     static void *       InUse(void *ptr);
     static void         UpdateInUseRange(Chunk_vp chunk);
     static void         ScheduleDelete(Chunk_vp);
+    static Chunk_vp &   NextBatch(Chunk_vp batch);
+    static void         ReleaseThreadCaches();
     bool                CheckLeakedPointers();
     bool                Sweep();
     void                ResetStatistics();
@@ -117,6 +129,7 @@ public:
         ALLOCATED       = 0,            // Just allocated
         IN_USE          = 1             // Set if already marked this time
     };
+    enum { BATCH_SIZE   = 64 };         // Chunks moved to or from threads
 
 public:
     struct Listener
@@ -129,9 +142,16 @@ public:
     void AddListener(Listener *l) { listeners.insert(l); }
     bool CanDelete(void *object);
 
+protected:
+    ThreadCache &       LocalCache();
+    Chunk_vp            Refill(ThreadCache &cache);
+    void                Flush(ThreadCache &cache, uint keep);
+    void                PushBatch(Chunk_vp batch, uint count);
+
 protected:
     GarbageCollector *  gc;
     kstring             name;
+    uint                index;
     Atomic<uint>        locked;
     Atomic<uintptr_t>   lowestInUse;
     Atomic<uintptr_t>   highestInUse;
@@ -141,6 +161,8 @@ protected:
     Atomic<Chunk_vp>    toDelete;
     Atomic<uint>        available;
     Atomic<uint>        freedCount;
+    Atomic<uint>        refillCount;
+    Atomic<uint>        returnCount;
 
     uint                chunkSize;
     uint                objectSize;
@@ -159,6 +181,7 @@ public:
     static void *       lowestAllocatorAddress;
     static void *       highestAllocatorAddress;
     static Atomic<uint> finalizing;
+    static bool         deferred;
 } __attribute__((aligned(16)));
 
 
@@ -281,6 +304,78 @@ protected:
 };
 
 
+template<class Object>
+struct FramePtr
+// ----------------------------------------------------------------------------
+//   A reference from an evaluation frame, not counted in deferred mode
+// ----------------------------------------------------------------------------
+//   In deferred mode, objects whose count drops to zero are only freed
+//   by the next collection, which first counts references from the roots
+//   registered with the collector, e.g. evaluation frames. Until then,
+//   an object read from a frame remains valid without being marked 'in use'.
+{
+    typedef TypeAllocator TA;
+
+    FramePtr(): pointer(0)                      { }
+    FramePtr(Object *ptr): pointer(ptr)         { Acquire(pointer); }
+    FramePtr(const FramePtr &ptr)
+        : pointer(ptr.pointer)                  { Acquire(pointer); }
+    template<class U, typename V>
+    FramePtr(const GCPtr<U,V> &p)
+        : pointer((U*) p.Pointer())             { Acquire(pointer); }
+    ~FramePtr()                                 { Release(pointer); }
+
+    operator Object* () const
+    {
+        if (TA::deferred)
+            return pointer;
+        return (Object *) TA::InUse(pointer);
+    }
+
+    Object *Pointer() const                     { return pointer; }
+    Object *operator->() const                  { return pointer; }
+    Object& operator*() const                   { return *pointer; }
+
+    FramePtr &operator= (Object *newVal)
+    {
+        Object *oldVal = pointer;
+        pointer = newVal;
+        if (newVal != oldVal)
+        {
+            Acquire(newVal);
+            Release(oldVal);
+        }
+        return *this;
+    }
+
+    FramePtr &operator= (const FramePtr &o)
+    {
+        return operator=(o.pointer);
+    }
+
+    template<class U, typename V>
+    FramePtr& operator=(const GCPtr<U,V> &o)
+    {
+        return operator=((Object *) o.Pointer());
+    }
+
+    static void Acquire(Object *ptr)
+    {
+        if (!TA::deferred)
+            TA::Acquire(ptr);
+    }
+
+    static void Release(Object *ptr)
+    {
+        if (!TA::deferred)
+            TA::Release(ptr);
+    }
+
+protected:
+    Object *    pointer;
+};
+
+
 
 // ****************************************************************************
 // 
@@ -314,6 +409,15 @@ struct GarbageCollector
     void                        PrintStatistics();
     void                        Register(TypeAllocator *a);
 
+    struct Roots
+    {
+        // References that are not counted, e.g. from evaluation frames
+        virtual ~Roots() {}
+        virtual void            Acquire() = 0;  // Count them before collecting
+        virtual void            Release() = 0;  // Drop them after collecting
+    };
+    static void                 AddRoots(Roots *roots);
+
 private:
     // Collection happens at SafePoint, you can't trigger it manually.
     bool                        Collect();
@@ -321,14 +425,17 @@ private:
 private:
     typedef std::vector<TypeAllocator *> Allocators;
     typedef TypeAllocator::Listeners     Listeners;
+    typedef std::vector<Roots *>         RootsList;
 
     static GarbageCollector *   gc;
 
     Allocators                  allocators;
+    RootsList                   roots;
     Atomic<uint>                mustRun;
     Atomic<uint>                running;
 
     friend void ::debuggc(void *ptr);
+    friend struct TypeAllocator;
 };
 
 
@@ -384,6 +491,15 @@ inline TypeAllocator *TypeAllocator::AllocatorPointer(TypeAllocator *ptr)
 }
 
 
+inline TypeAllocator::Chunk_vp &TypeAllocator::NextBatch(Chunk_vp batch)
+// ----------------------------------------------------------------------------
+//   The link to the next batch, stored in the object of the first chunk
+// ----------------------------------------------------------------------------
+{
+    return *(Chunk_vp *) (batch + 1);
+}
+
+
 inline bool TypeAllocator::IsGarbageCollected(void *ptr)
 // ----------------------------------------------------------------------------
 //   Tell if a pointer is managed by the garbage collector
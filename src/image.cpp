@@ -0,0 +1,579 @@
+// ****************************************************************************
+//  image.cpp                                                     ELIOT project
+// ****************************************************************************
+//
+//   File Description:
+//
+//     Precompiled images of source files, loaded at startup without parsing
+//
+//
+//
+//
+//
+//
+//
+// ****************************************************************************
+//  (C) 2015 Christophe de Dinechin <christophe@taodyne.com>
+//  (C) 2015 Taodyne SAS
+// ****************************************************************************
+
+#include "image.h"
+#include "scanner.h"
+#include "options.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifndef CONFIG_MINGW
+#include <sys/mman.h>
+#endif // CONFIG_MINGW
+
+
+ELIOT_BEGIN
+
+// ============================================================================
+//
+//   Mapping files in memory
+//
+// ============================================================================
+
+struct MappedFile
+// ----------------------------------------------------------------------------
+//   A read-only view of a whole file
+// ----------------------------------------------------------------------------
+{
+    MappedFile(text name);
+    ~MappedFile();
+
+public:
+    const byte *        data;
+    ulonglong           size;
+    bool                valid;
+#ifdef CONFIG_MINGW
+    text                contents;
+#endif // CONFIG_MINGW
+};
+
+
+MappedFile::MappedFile(text name)
+// ----------------------------------------------------------------------------
+//   Map the file if it exists
+// ----------------------------------------------------------------------------
+    : data(NULL), size(0), valid(false)
+{
+#ifndef CONFIG_MINGW
+    int fd = open(name.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0)
+    {
+        valid = true;
+        if (st.st_size > 0)
+        {
+            void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED)
+            {
+                data = (const byte *) map;
+                size = st.st_size;
+            }
+            else
+            {
+                valid = false;
+            }
+        }
+    }
+    close(fd);
+#else // CONFIG_MINGW
+    std::ifstream input(name.c_str(), std::ios::in | std::ios::binary);
+    if (input.good())
+    {
+        std::stringstream buffer;
+        buffer << input.rdbuf();
+        contents = buffer.str();
+        data = (const byte *) contents.data();
+        size = contents.size();
+        valid = true;
+    }
+#endif // CONFIG_MINGW
+}
+
+
+MappedFile::~MappedFile()
+// ----------------------------------------------------------------------------
+//   Unmap the file
+// ----------------------------------------------------------------------------
+{
+#ifndef CONFIG_MINGW
+    if (data)
+        munmap((void *) data, size);
+#endif // CONFIG_MINGW
+}
+
+
+
+// ============================================================================
+//
+//   Reading and writing images
+//
+// ============================================================================
+
+text Image::Name(text source)
+// ----------------------------------------------------------------------------
+//   Name of the image file for a given source
+// ----------------------------------------------------------------------------
+{
+    return source + ".image";
+}
+
+
+ulonglong Image::Hash(const byte *data, ulonglong size)
+// ----------------------------------------------------------------------------
+//   Hash the source file (64-bit FNV-1a)
+// ----------------------------------------------------------------------------
+{
+    ulonglong hash = 0xCBF29CE484222325ULL;
+    for (ulonglong i = 0; i < size; i++)
+    {
+        hash ^= data[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+
+uint Image::Flags()
+// ----------------------------------------------------------------------------
+//   Options that change the parse tree for the same source
+// ----------------------------------------------------------------------------
+{
+    uint flags = 0;
+    if (Options *options = Options::options)
+    {
+        if (options->signedConstants)
+            flags |= 1;
+        if (options->case_sensitive)
+            flags |= 2;
+    }
+    return flags;
+}
+
+
+Tree *Image::Load(text source, Positions &positions)
+// ----------------------------------------------------------------------------
+//   Load the tree from the image if it matches the source, else NULL
+// ----------------------------------------------------------------------------
+{
+    text name = Name(source);
+    MappedFile image(name);
+    if (image.size < sizeof(Header))
+        return NULL;
+
+    const Header *header = (const Header *) image.data;
+    if (header->magic != imageMAGIC ||
+        header->version != imageVERSION ||
+        header->flags != Flags())
+    {
+        IFTRACE(fileload)
+            std::cerr << "Image " << name << " has the wrong format\n";
+        return NULL;
+    }
+
+    MappedFile input(source);
+    if (!input.valid ||
+        input.size != header->size ||
+        Hash(input.data, input.size) != header->hash)
+    {
+        IFTRACE(fileload)
+            std::cerr << "Image " << name << " is out of date\n";
+        return NULL;
+    }
+
+    TreePosition base = positions.OpenFile(source);
+    ImageReader reader(image.data + sizeof(Header),
+                       image.data + image.size, base);
+    reader.texts.reserve(header->texts);
+    Tree *tree = reader.ReadTree();
+    if (!reader.IsValid() || reader.ptr != reader.end)
+    {
+        IFTRACE(fileload)
+            std::cerr << "Image " << name << " is corrupt\n";
+        positions.CloseFile(base);
+        return NULL;
+    }
+    positions.CloseFile(base + input.size);
+
+    IFTRACE(fileload)
+        std::cerr << "Loaded image " << name << "\n";
+    return tree;
+}
+
+
+bool Image::Save(text source, Tree *tree, Positions &positions)
+// ----------------------------------------------------------------------------
+//   Write the image for the tree parsed from the given source
+// ----------------------------------------------------------------------------
+{
+    MappedFile input(source);
+    if (!input.valid)
+        return false;
+
+    ImageWriter writer(source, positions);
+    writer.WriteTree(tree);
+
+    Header header;
+    header.magic = imageMAGIC;
+    header.version = imageVERSION;
+    header.flags = Flags();
+    header.texts = writer.texts.size();
+    header.hash = Hash(input.data, input.size);
+    header.size = input.size;
+
+    text name = Name(source);
+    std::ofstream output(name.c_str(), std::ios::out | std::ios::binary);
+    output.write((const char *) &header, sizeof(header));
+    output.write(writer.data.data(), writer.data.size());
+
+    IFTRACE(fileload)
+        std::cerr << "Wrote image " << name
+                  << " (" << sizeof(header) + writer.data.size()
+                  << " bytes)\n";
+    return output.good();
+}
+
+
+
+// ============================================================================
+//
+//   Class ImageWriter : Encode the tree
+//
+// ============================================================================
+
+void ImageWriter::WriteTree(Tree *tree)
+// ----------------------------------------------------------------------------
+//   Write a node followed by its children
+// ----------------------------------------------------------------------------
+{
+    if (!tree)
+    {
+        WriteUnsigned(imageNULL);
+        return;
+    }
+
+    switch(tree->Kind())
+    {
+    case INTEGER:
+        WriteUnsigned(imageINTEGER);
+        WritePosition(tree->Position());
+        WriteSigned(((Integer *) tree)->value);
+        break;
+    case REAL:
+    {
+        double value = ((Real *) tree)->value;
+        WriteUnsigned(imageREAL);
+        WritePosition(tree->Position());
+        data.append((const char *) &value, sizeof(value));
+        break;
+    }
+    case TEXT:
+    {
+        Text *t = (Text *) tree;
+        WriteUnsigned(imageTEXT);
+        WritePosition(tree->Position());
+        WriteText(t->opening);
+        WriteText(t->value);
+        WriteText(t->closing);
+        break;
+    }
+    case NAME:
+        WriteUnsigned(imageNAME);
+        WritePosition(tree->Position());
+        WriteText(((Name *) tree)->value);
+        break;
+    case BLOCK:
+    {
+        Block *b = (Block *) tree;
+        WriteUnsigned(imageBLOCK);
+        WritePosition(tree->Position());
+        WriteText(b->opening);
+        WriteText(b->closing);
+        WriteTree(b->child);
+        break;
+    }
+    case PREFIX:
+    {
+        Prefix *p = (Prefix *) tree;
+        WriteUnsigned(imagePREFIX);
+        WritePosition(tree->Position());
+        WriteTree(p->left);
+        WriteTree(p->right);
+        break;
+    }
+    case POSTFIX:
+    {
+        Postfix *p = (Postfix *) tree;
+        WriteUnsigned(imagePOSTFIX);
+        WritePosition(tree->Position());
+        WriteTree(p->left);
+        WriteTree(p->right);
+        break;
+    }
+    case INFIX:
+    {
+        Infix *i = (Infix *) tree;
+        WriteUnsigned(imageINFIX);
+        WritePosition(tree->Position());
+        WriteText(i->name);
+        WriteTree(i->left);
+        WriteTree(i->right);
+        break;
+    }
+    }
+}
+
+
+void ImageWriter::WriteUnsigned(ulonglong value)
+// ----------------------------------------------------------------------------
+//   Write an unsigned value, 7 bits at a time
+// ----------------------------------------------------------------------------
+{
+    byte b;
+    do
+    {
+        b = value & 0x7F;
+        value >>= 7;
+        if (value != 0)
+            b |= 0x80;
+        data += char(b);
+    } while (b & 0x80);
+}
+
+
+void ImageWriter::WriteSigned(longlong value)
+// ----------------------------------------------------------------------------
+//   Write a signed value, 7 bits at a time
+// ----------------------------------------------------------------------------
+{
+    byte b;
+    do
+    {
+        b = value & 0x7F;
+        value >>= 7;
+        if ((value != 0 && value != -1) || (value & 0x40) != (b & 0x40))
+            b |= 0x80;
+        data += char(b);
+    } while (b & 0x80);
+}
+
+
+void ImageWriter::WriteText(const text &value)
+// ----------------------------------------------------------------------------
+//   Write a text the first time, then its index in the text table
+// ----------------------------------------------------------------------------
+{
+    std::map<text,uint>::iterator found = texts.find(value);
+    if (found != texts.end())
+    {
+        WriteSigned(-longlong((*found).second));
+    }
+    else
+    {
+        uint index = texts.size() + 1;
+        texts[value] = index;
+        WriteSigned(value.length());
+        data.append(value);
+    }
+}
+
+
+void ImageWriter::WritePosition(TreePosition pos)
+// ----------------------------------------------------------------------------
+//   Write a position relative to the start of the source file
+// ----------------------------------------------------------------------------
+{
+    text  file;
+    ulong offset = 0;
+    if (pos != Tree::NOWHERE)
+        positions.GetFile(pos, &file, &offset);
+    if (pos == Tree::NOWHERE || file != source)
+        WriteUnsigned(0);
+    else
+        WriteUnsigned(offset + 1);
+}
+
+
+
+// ============================================================================
+//
+//   Class ImageReader : Rebuild the tree from mapped memory
+//
+// ============================================================================
+
+Tree *ImageReader::ReadTree()
+// ----------------------------------------------------------------------------
+//   Read a node and its children
+// ----------------------------------------------------------------------------
+{
+    if (!valid)
+        return NULL;
+
+    ImageTag tag = ImageTag(ReadUnsigned());
+    if (tag == imageNULL)
+        return NULL;
+
+    TreePosition pos = ReadPosition();
+    text         name, opening, closing;
+    Tree        *left, *right;
+    Tree        *result = NULL;
+
+    switch(tag)
+    {
+    case imageINTEGER:
+        result = new Integer(ReadSigned(), pos);
+        break;
+    case imageREAL:
+    {
+        double value = 0.0;
+        if (end - ptr < (long) sizeof(value))
+        {
+            valid = false;
+            break;
+        }
+        memcpy(&value, ptr, sizeof(value));
+        ptr += sizeof(value);
+        result = new Real(value, pos);
+        break;
+    }
+    case imageTEXT:
+        opening = ReadText();
+        name = ReadText();
+        closing = ReadText();
+        result = new Text(name, opening, closing, pos);
+        break;
+    case imageNAME:
+        result = new Name(ReadText(), pos);
+        break;
+    case imageBLOCK:
+        opening = ReadText();
+        closing = ReadText();
+        left = ReadTree();
+        result = new Block(left, opening, closing, pos);
+        break;
+    case imagePREFIX:
+        left = ReadTree();
+        right = ReadTree();
+        result = new Prefix(left, right, pos);
+        break;
+    case imagePOSTFIX:
+        left = ReadTree();
+        right = ReadTree();
+        result = new Postfix(left, right, pos);
+        break;
+    case imageINFIX:
+        name = ReadText();
+        left = ReadTree();
+        right = ReadTree();
+        result = new Infix(name, left, right, pos);
+        break;
+    default:
+        valid = false;
+        break;
+    }
+
+    return result;
+}
+
+
+ulonglong ImageReader::ReadUnsigned()
+// ----------------------------------------------------------------------------
+//   Read an unsigned value, 7 bits at a time
+// ----------------------------------------------------------------------------
+{
+    ulonglong value = 0;
+    uint      shift = 0;
+    byte      b;
+    do
+    {
+        if (ptr >= end || shift >= 64)
+        {
+            valid = false;
+            return 0;
+        }
+        b = *ptr++;
+        value |= ulonglong(b & 0x7F) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    return value;
+}
+
+
+longlong ImageReader::ReadSigned()
+// ----------------------------------------------------------------------------
+//   Read a signed value, 7 bits at a time
+// ----------------------------------------------------------------------------
+{
+    ulonglong value = 0;
+    uint      shift = 0;
+    byte      b;
+    do
+    {
+        if (ptr >= end || shift >= 64)
+        {
+            valid = false;
+            return 0;
+        }
+        b = *ptr++;
+        value |= ulonglong(b & 0x7F) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    if (shift < 64 && (b & 0x40))
+        value |= ~0ULL << shift;
+    return longlong(value);
+}
+
+
+text ImageReader::ReadText()
+// ----------------------------------------------------------------------------
+//   Read a new text, or a reference to a text already read
+// ----------------------------------------------------------------------------
+{
+    longlong length = ReadSigned();
+    if (length < 0)
+    {
+        ulonglong index = -length;
+        if (index > texts.size())
+        {
+            valid = false;
+            return "";
+        }
+        return texts[index - 1];
+    }
+    if (end - ptr < length)
+    {
+        valid = false;
+        return "";
+    }
+    text result((const char *) ptr, length);
+    ptr += length;
+    texts.push_back(result);
+    return result;
+}
+
+
+TreePosition ImageReader::ReadPosition()
+// ----------------------------------------------------------------------------
+//   Read a position and relocate it to where the source was opened
+// ----------------------------------------------------------------------------
+{
+    ulonglong offset = ReadUnsigned();
+    if (offset == 0)
+        return Tree::NOWHERE;
+    return base + offset - 1;
+}
+
+ELIOT_END
@@ -0,0 +1,129 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+// ****************************************************************************
+//  image.h                                                       ELIOT project
+// ****************************************************************************
+//
+//   File Description:
+//
+//     Precompiled images of source files, loaded at startup without parsing
+//
+//
+//
+//
+//
+//
+//
+// ****************************************************************************
+//  (C) 2015 Christophe de Dinechin <christophe@taodyne.com>
+//  (C) 2015 Taodyne SAS
+// ****************************************************************************
+//
+//   An image is written next to the source file with the -image option,
+//   e.g. builtins.eliot.image for builtins.eliot. It records the hash and
+//   size of the source it was built from, then the parse tree with its
+//   source positions and a shared table of names and texts.
+//
+//   At startup, the image is memory-mapped and the tree is rebuilt directly
+//   from the mapped bytes if the source still hashes to the same value.
+//   Otherwise, the image is silently ignored and the source is parsed.
+//   Bytecode is then compiled lazily from the loaded tree as usual.
+
+#include "base.h"
+#include "tree.h"
+#include <vector>
+#include <map>
+
+
+ELIOT_BEGIN
+
+struct Positions;
+
+
+enum ImageTag
+// ----------------------------------------------------------------------------
+//   Kind of node recorded in the image
+// ----------------------------------------------------------------------------
+{
+    imageNULL,
+    imageINTEGER, imageREAL, imageTEXT, imageNAME,
+    imageBLOCK, imagePREFIX, imagePOSTFIX, imageINFIX,
+
+    imageVERSION = 0x0100,
+    imageMAGIC   = 0x494C4558   // "XELI" in memory on little-endian hosts
+};
+
+
+struct Image
+// ----------------------------------------------------------------------------
+//   Read and write precompiled images of a source file
+// ----------------------------------------------------------------------------
+{
+    static text         Name(text source);
+    static Tree *       Load(text source, Positions &positions);
+    static bool         Save(text source, Tree *tree, Positions &positions);
+
+public:
+    struct Header
+    {
+        uint            magic;
+        uint            version;
+        uint            flags;
+        uint            texts;
+        ulonglong       hash;
+        ulonglong       size;
+    };
+
+    static ulonglong    Hash(const byte *data, ulonglong size);
+    static uint         Flags();
+};
+
+
+struct ImageWriter
+// ----------------------------------------------------------------------------
+//   Encode a tree and its positions into an image body
+// ----------------------------------------------------------------------------
+{
+    ImageWriter(text source, Positions &positions)
+        : source(source), positions(positions), data(), texts() {}
+
+    void                WriteTree(Tree *tree);
+    void                WriteUnsigned(ulonglong value);
+    void                WriteSigned(longlong value);
+    void                WriteText(const text &value);
+    void                WritePosition(TreePosition pos);
+
+public:
+    text                source;
+    Positions &         positions;
+    text                data;
+    std::map<text,uint> texts;
+};
+
+
+struct ImageReader
+// ----------------------------------------------------------------------------
+//   Rebuild a tree from a mapped image body
+// ----------------------------------------------------------------------------
+{
+    ImageReader(const byte *data, const byte *end, TreePosition base)
+        : ptr(data), end(end), base(base), valid(true), texts() {}
+
+    Tree *              ReadTree();
+    ulonglong           ReadUnsigned();
+    longlong            ReadSigned();
+    text                ReadText();
+    TreePosition        ReadPosition();
+    bool                IsValid()       { return valid; }
+
+public:
+    const byte *        ptr;
+    const byte *        end;
+    TreePosition        base;
+    bool                valid;
+    std::vector<text>   texts;
+};
+
+ELIOT_END
+
+#endif // IMAGE_H
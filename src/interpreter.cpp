@@ -25,6 +25,8 @@
 #include "types.h"
 #include "renderer.h"
 #include "basics.h"
+#include "bytecode.h"
+#include "memo.h"
 
 #include <cmath>
 #include <algorithm>
@@ -98,9 +100,11 @@ struct Bindings
     typedef bool value_type;
 
     Bindings(Context *context, Context *locals,
-             Tree *test, EvalCache &cache, TreeList &args)
+             Tree *test, EvalCache &cache, TreeList &args,
+             bool suspend = false)
         : context(context), locals(locals),
-          test(test), cache(cache), resultType(NULL), args(args) {}
+          test(test), cache(cache), suspend(suspend),
+          resultType(NULL), args(args) {}
 
     // Tree::Do interface
     bool  DoInteger(Integer *what);
@@ -123,10 +127,14 @@ private:
     Context_p  locals;
     Tree_p     test;
     EvalCache  &cache;
+    bool       suspend;
 
 public:
     Tree_p      resultType;
     TreeList   &args;
+    TreeList    names;
+    Tree_p      pending;        // Argument to evaluate before retrying
+    Context_p   pendingContext; // Context to evaluate it in
 };
 
 
@@ -136,6 +144,8 @@ inline bool Bindings::DoInteger(Integer *what)
 // ----------------------------------------------------------------------------
 {
     MustEvaluate();
+    if (pending)
+        return false;
     if (Integer *ival = test->AsInteger())
         if (ival->value == what->value)
             return true;
@@ -150,6 +160,8 @@ inline bool Bindings::DoReal(Real *what)
 // ----------------------------------------------------------------------------
 {
     MustEvaluate();
+    if (pending)
+        return false;
     if (Real *rval = test->AsReal())
         if (rval->value == what->value)
             return true;
@@ -164,6 +176,8 @@ inline bool Bindings::DoText(Text *what)
 // ----------------------------------------------------------------------------
 {
     MustEvaluate();
+    if (pending)
+        return false;
     if (Text *tval = test->AsText())
         if (tval->value == what->value)         // Do delimiters matter?
             return true;
@@ -189,6 +203,8 @@ inline bool Bindings::DoName(Name *what)
     if (Tree *bound = locals->Bound(what))
     {
         MustEvaluate(true);
+        if (pending)
+            return false;
         bool result = Tree::Equal(bound, test);
         IFTRACE(eval)
             std::cerr << "  ARGCHECK: "
@@ -314,7 +330,7 @@ bool Bindings::DoInfix(Infix *what)
     Save<Context_p> saveContext(context, context);
 
     // Check if we have typed arguments, e.g. X:integer
-    if (what->name == ":")
+    if (what->name == symColon)
     {
         Name *name = what->left->AsName();
         if (!name)
@@ -325,10 +341,14 @@ bool Bindings::DoInfix(Infix *what)
 
         // Typed name: evaluate type and check match
         Tree *type = MustEvaluate(context, what->right);
+        if (pending)
+            return false;
         Tree *checked = TypeCheck(context, type, test);
         if (!checked || type == ELIOT::value_type)
         {
             MustEvaluate(type != ELIOT::value_type);
+            if (pending)
+                return false;
             checked = TypeCheck(context, type, test);
         }
         if (checked)
@@ -343,7 +363,7 @@ bool Bindings::DoInfix(Infix *what)
     }
 
     // Check if we have typed declarations, e.g. X+Y as integer
-    if (what->name == "as")
+    if (what->name == symAs)
     {
         if (resultType)
         {
@@ -351,11 +371,13 @@ bool Bindings::DoInfix(Infix *what)
             Ooops("Previously declared type was $1", resultType);
         }
         resultType = MustEvaluate(context, what->right);
+        if (pending)
+            return false;
         return what->left->Do(this);
     }
 
     // Check if we have a guard clause
-    if (what->name == "when")
+    if (what->name == symWhen)
     {
         // It must pass the rest (need to bind values first)
         if (!what->left->Do(this))
@@ -363,6 +385,8 @@ bool Bindings::DoInfix(Infix *what)
 
         // Here, we need to evaluate in the local context, not eval one
         Tree *check = MustEvaluate(locals, what->right);
+        if (pending)
+            return false;
         if (check == eliot_true)
             return true;
         else if (check != eliot_false)
@@ -378,6 +402,8 @@ bool Bindings::DoInfix(Infix *what)
     {
         // Try to get an infix by evaluating what we have
         MustEvaluate(true);
+        if (pending)
+            return false;
         ifx = test->AsInfix();
     }
     if (ifx)
@@ -411,6 +437,13 @@ void Bindings::MustEvaluate(bool updateContext)
     Tree *evaluated = cache[test];
     if (!evaluated)
     {
+        // Past the native depth, let the evaluator do it on its own stack
+        if (suspend)
+        {
+            pending = test;
+            pendingContext = context;
+            return;
+        }
         evaluated = EvaluateClosure(context, test);
         cache[test] = evaluated;
         IFTRACE(eval)
@@ -440,6 +473,12 @@ Tree *Bindings::MustEvaluate(Context *context, Tree *tval)
     Tree *evaluated = cache[tval];
     if (!evaluated)
     {
+        if (suspend)
+        {
+            pending = tval;
+            pendingContext = context;
+            return tval;
+        }
         evaluated = EvaluateClosure(context, tval);
         cache[tval] = evaluated;
         IFTRACE(eval)
@@ -466,6 +505,7 @@ void Bindings::Bind(Name *name, Tree *value)
     IFTRACE(eval)
         std::cerr << "  BIND " << name << "=" << ShortTreeForm(value) <<"\n";
     args.push_back(value);
+    names.push_back(name);
     locals->Define(name, value);
 }
 
@@ -487,7 +527,80 @@ void Bindings::BindClosure(Name *name, Tree *value)
 //
 // ============================================================================
 
-static Tree *error_result = NULL;
+Evaluator *Evaluator::current = NULL;
+
+
+struct Frame
+// ----------------------------------------------------------------------------
+//   A continuation frame on the evaluation stack
+// ----------------------------------------------------------------------------
+//   A frame evaluates 'what' in 'context' one step at a time. When a step
+//   needs the value of some other tree, it pushes a new frame for it and
+//   records in 'wait' what to do with that value when the frame resumes.
+{
+    enum Wait { NONE, SEQUENCE, SCOPED, CALLEE, ARGUMENT, LOOKUP };
+
+    Frame(Context *context, Tree *what, uint depth, bool closure)
+        : context(context), what(what), result(what),
+          original(context->CurrentScope()), cache(), depth(depth),
+          wait(NONE), declare(closure), closure(closure), retry(false),
+          errors(0), contextErrors(0) {}
+
+    Context_p   context;        // Context we evaluate in
+    Tree_p      what;           // Tree being evaluated
+    Tree_p      result;         // Last result, e.g. for sequences
+    Scope_p     original;       // Scope the evaluation started in
+    EvalCache   cache;          // Arguments evaluated for current lookup
+    uint        depth;          // Evaluation depth for lookups
+    Wait        wait;           // What the frame is waiting for
+    bool        declare;        // Declarations must be processed first
+    bool        closure;        // Evaluate as with EvaluateClosure
+    bool        retry;          // Retry lookup with the cached arguments
+    Tree_p      callee;         // Callee of a prefix, once evaluated
+    Tree_p      value;          // Value returned by the frame above
+    Tree_p      pending;        // Argument the lookup is waiting for
+    Context_p   pendingContext; // Context to evaluate it in
+    uint        errors;         // Errors logged before the lookup
+    ulong       contextErrors;
+};
+
+
+static Tree *promote(Scope *declScope, Infix *decl, Tree *type,
+                     TreeList &names, TreeList &args)
+// ----------------------------------------------------------------------------
+//   Count calls to a rewrite, and run it as bytecode once it is hot
+// ----------------------------------------------------------------------------
+{
+    TierInfo *tier = decl->GetInfo<TierInfo>();
+    if (!tier)
+    {
+        tier = new TierInfo;
+        decl->SetInfo<TierInfo>(tier);
+    }
+    if (tier->failed)
+        return NULL;
+
+    // Only calls with constant arguments are run as bytecode. Anything else
+    // may be a lazy argument that must be evaluated in the caller's scope
+    for (TreeList::iterator a = args.begin(); a != args.end(); a++)
+        if ((*a)->Kind() >= NAME)
+            return NULL;
+
+    if (tier->count < MAIN->options.promote_calls)
+    {
+        tier->count++;
+        return NULL;
+    }
+
+    Tree *result = CallWithBytecode(declScope, decl, type, names, args);
+    if (!result)
+    {
+        IFTRACE(eval)
+            std::cerr << "PROMOTE " << decl->left << " FAILED\n";
+        tier->failed = true;
+    }
+    return result;
+}
 
 
 static Tree *evalLookup(Scope *evalScope, Scope *declScope,
@@ -496,7 +609,8 @@ static Tree *evalLookup(Scope *evalScope, Scope *declScope,
 //   Calllback function to check if the candidate matches
 // ----------------------------------------------------------------------------
 {
-    static uint depth = 0;
+    Evaluator *evaluator = Evaluator::current;
+    uint &depth = evaluator->depth;
     Save<uint> saveDepth(depth, depth+1);
     IFTRACE(eval)
         std::cerr << "EVAL" << depth << "(" << self
@@ -504,16 +618,18 @@ static Tree *evalLookup(Scope *evalScope, Scope *declScope,
     if (depth > MAIN->options.stack_depth)
     {
         Ooops("Stack depth exceeded evaluating $1", self);
-        return error_result = eliot_error;
+        return evaluator->error = eliot_error;
     }
-    else if (error_result)
+    else if (evaluator->error)
     {
-        return error_result;
+        return evaluator->error;
     }
 
-    // Create the scope for evaluation
-    Context_p context = new Context(evalScope);
-    Context_p locals  = NULL;
+    // Borrow the contexts for evaluation and local bindings. They are only
+    // left to the garbage collector if the bindings escape, e.g. in a closure
+    PooledContext context(evalScope);
+    PooledContext pooledLocals(declScope, true);
+    Context *locals = NULL;
     Tree *result = NULL;
 
     // Check if the decl is an opcode or C binding
@@ -526,7 +642,7 @@ static Tree *evalLookup(Scope *evalScope, Scope *declScope,
     // If we lookup a name or a number, just return it
     Tree *defined = RewriteDefined(decl->left);
     Tree *resultType = tree_type;
-    TreeList args;
+    TreeList args, names;
     if (defined->IsLeaf())
     {
         // Must match literally, or we don't have a candidate
@@ -542,17 +658,28 @@ static Tree *evalLookup(Scope *evalScope, Scope *declScope,
     }
     else
     {
-        // Retrieve the evaluation cache for arguments
-        EvalCache *cache = (EvalCache *) ec;
+        // Retrieve the frame holding the evaluation cache for arguments
+        Frame *frame = (Frame *) ec;
 
-        // Create the scope for evaluation and local bindings
-        locals = new Context(declScope);
-        locals->CreateScope();
+        // Use the scope for local bindings
+        locals = pooledLocals;
 
         // Check bindings of arguments to declaration, exit if fails
-        Bindings  bindings(context, locals, self, *cache, args);
+        // Past the native depth, arguments are evaluated in a new frame
+        bool suspend = evaluator->nested >= MAIN->options.native_depth;
+        Bindings  bindings(context, locals, self, frame->cache, args, suspend);
         if (!decl->left->Do(bindings))
         {
+            if (bindings.pending)
+            {
+                IFTRACE(eval)
+                    std::cerr << "EVAL" << depth << "(" << self
+                              << ") from " << decl->left
+                              << " NEEDS " << bindings.pending << "\n";
+                frame->pending = bindings.pending;
+                frame->pendingContext = bindings.pendingContext;
+                return frame->pending;
+            }
             IFTRACE(eval)
                 std::cerr << "EVAL" << depth << "(" << self
                           << ") from " << decl->left
@@ -561,6 +688,7 @@ static Tree *evalLookup(Scope *evalScope, Scope *declScope,
         }
         if (bindings.resultType)
             resultType = bindings.resultType;
+        std::swap(names, bindings.names);
     }
 
     // Check if the right is "self"
@@ -578,10 +706,10 @@ static Tree *evalLookup(Scope *evalScope, Scope *declScope,
     {
         // Cached callback
         uint offset = args.size();
-        std::reverse(args.begin(), args.end());
-        args.push_back(decl->right);
-        args.push_back(context->CurrentScope());
-        Data data = &args[offset];
+        Slots frame(args.rbegin(), args.rend());
+        frame.push_back(decl->right);
+        frame.push_back(context->CurrentScope());
+        Data data = &frame[offset];
         opcode->Run(data);
         result = DataResult(data);
         IFTRACE(eval)
@@ -592,11 +720,57 @@ static Tree *evalLookup(Scope *evalScope, Scope *declScope,
         return result;
     }
 
+    // Check if the result was memoized for these arguments
+    Tree *body = decl->right;
+    Memo *memo = MemoInfo(decl);
+    bool memoize = false;
+    if (memo)
+    {
+        body = memo->body;
+        memoize = Memo::Cacheable(args);
+        if (memoize)
+        {
+            if (Tree *cached = memo->Find(args))
+            {
+                IFTRACE(eval)
+                    std::cerr << "EVAL" << depth << "(" << self
+                              << ") MEMO = " << cached << "\n";
+                return cached;
+            }
+        }
+    }
+
+    // At -O2, rewrites that were called often enough run as bytecode
+    if (MAIN->options.optimize_level == 2 && !defined->IsLeaf())
+    {
+        Tree *type = resultType != tree_type ? resultType : NULL;
+        if (Tree *promoted = promote(declScope, decl, type, names, args))
+        {
+            IFTRACE(eval)
+                std::cerr << "EVAL" << depth << "(" << self
+                          << ") BYTECODE = " << promoted << "\n";
+            if (memoize)
+                memo->Enter(args, promoted);
+            return promoted;
+        }
+    }
+
     // Normal case: evaluate body of the declaration in the new context
-    result = decl->right;
+    result = body;
     if (resultType != tree_type)
         result = new Infix("as", result, resultType, self->Position());
 
+    // Memoized results must be computed now to be recorded
+    if (memoize)
+    {
+        result = Evaluate(locals, result);
+        memo->Enter(args, result);
+        IFTRACE(eval)
+            std::cerr << "EVAL" << depth << "(" << self
+                      << ") MEMO MISS = " << result << "\n";
+        return result;
+    }
+
     result = MakeClosure(locals, result);
     IFTRACE(eval)
         std::cerr << "EVAL" << depth << " BINDINGS: "
@@ -608,6 +782,95 @@ static Tree *evalLookup(Scope *evalScope, Scope *declScope,
 }
 
 
+Evaluator::Evaluator(Context *context, Tree *what)
+// ----------------------------------------------------------------------------
+//   Prepare to evaluate 'what' as EvaluateClosure would
+// ----------------------------------------------------------------------------
+    : frames(), result(what), error(), depth(0), nested(0), completed(0)
+{
+    if (current)
+        depth = current->depth;
+    frames.push_back(new Frame(context, what, depth, true));
+}
+
+
+Evaluator::~Evaluator()
+// ----------------------------------------------------------------------------
+//   Delete frames that remain if the evaluation was not completed
+// ----------------------------------------------------------------------------
+{
+    for (std::vector<Frame *>::iterator f = frames.begin();
+         f != frames.end();
+         f++)
+        delete *f;
+}
+
+
+Tree *Evaluator::Run(uint steps)
+// ----------------------------------------------------------------------------
+//   Run the evaluation, returning NULL if stopped after 'steps' steps
+// ----------------------------------------------------------------------------
+//   With 'steps' set to 0, run until the evaluation completes.
+//   Evaluators started from inside a lookup are nested on the C stack,
+//   they share the error state and count towards the native depth.
+{
+    Evaluator *outer = current;
+    Save<Evaluator *> saveCurrent(current, this);
+    if (outer)
+    {
+        nested = outer->nested + 1;
+        if (outer->error)
+            error = outer->error;
+    }
+
+    uint count = 0;
+    while (!frames.empty())
+    {
+        if (steps && count++ >= steps)
+        {
+            if (outer && error)
+                outer->error = error;
+            return NULL;
+        }
+
+        Frame *frame = frames.back();
+        depth = frame->depth;
+        Tree_p value = Step(frame);
+        if (!value)
+            continue;
+
+        // The frame is complete, pass its value to the frame below
+        bool closure = frame->closure;
+        frames.pop_back();
+        delete frame;
+
+        // This is a safe point for checking collection status. A collection
+        // scans what was allocated since the previous one, which for a deep
+        // stack of frames is most of the heap, so only do it periodically
+        if (closure && (completed++ % SAFE_POINT_FRAMES) == 0)
+            GarbageCollector::SafePoint();
+
+        if (frames.empty())
+            result = value;
+        else
+            frames.back()->value = value;
+    }
+
+    if (outer && error)
+        outer->error = error;
+    return result;
+}
+
+
+void Evaluator::Push(Context *context, Tree *what, uint depth, bool closure)
+// ----------------------------------------------------------------------------
+//   Push a new frame to evaluate 'what' in the given context
+// ----------------------------------------------------------------------------
+{
+    frames.push_back(new Frame(context, what, depth, closure));
+}
+
+
 inline Tree *encloseResult(Context *context, Scope *old, Tree *what)
 // ----------------------------------------------------------------------------
 //   Encapsulate result with a closure if context is not evaluation context
@@ -619,209 +882,287 @@ inline Tree *encloseResult(Context *context, Scope *old, Tree *what)
 }
 
 
-static Tree *Instructions(Context_p context, Tree_p what)
+Tree *Evaluator::Step(Frame *frame)
 // ----------------------------------------------------------------------------
-//   Evaluate the input tree once declarations have been processed
+//   Run one step of the top frame, return its value once it is complete
 // ----------------------------------------------------------------------------
+//   Steps that used to recurse (sequences, scoped references, prefixes
+//   and arguments needed by a lookup) push a frame and resume from 'wait'.
 {
-    Tree_p      result = what;
-    Scope_p     originalScope = context->CurrentScope();
+    Context_p  &context = frame->context;
+    Tree_p     &what = frame->what;
+    Frame::Wait wait = frame->wait;
+    frame->wait = Frame::NONE;
 
-    // Loop to avoid recursion for a few common cases, e.g. sequences, blocks
-    while (what)
+    switch (wait)
     {
-        // First attempt to look things up
-        EvalCache cache;
-        if (Tree *eval = context->Lookup(what, evalLookup, &cache))
+    case Frame::NONE:
+        // Create scope for declarations if evaluating as a closure
+        if (frame->declare)
         {
-            if (eval == eliot_error)
-                return eval;
-            MAIN->errors->Clear();
-            result = eval;
-            if (Tree *inside = IsClosure(eval, &context))
-            {
-                what = inside;
-                continue;
-            }
-            return encloseResult(context, originalScope, eval);
+            frame->declare = false;
+            Errors *errors = MAIN->errors;
+            uint errCount = errors->Count();
+            if (!context->ProcessDeclarations(what) ||
+                errCount != errors->Count())
+                return what;
+            frame->original = context->CurrentScope();
         }
+        break;
+
+    case Frame::SEQUENCE:
+    {
+        // Sequences: left was evaluated, now evaluate right
+        Infix *infix = (Infix *) (Tree *) what;
+        if (frame->value != infix->left)
+            frame->result = frame->value;
+        what = infix->right;
+        break;
+    }
+
+    case Frame::SCOPED:
+    {
+        // Scoped reference: left was evaluated, now lookup right inside
+        Infix *infix = (Infix *) (Tree *) what;
+        IsClosure(frame->value, &context);
+        what = infix->right;
+        break;
+    }
 
-        kind whatK = what->Kind();
-        switch (whatK)
+    case Frame::CALLEE:
+    {
+        // The callee was evaluated: if it changed, evaluate argument
+        Prefix *pfx = (Prefix *) (Tree *) what;
+        if (frame->value != frame->callee)
         {
-        case INTEGER:
-        case REAL:
-        case TEXT:
-            return what;
+            frame->callee = frame->value;
+            frame->wait = Frame::ARGUMENT;
+            Push(context, pfx->right, depth, false);
+            return NULL;
+        }
+
+        // If we get there, we didn't find anything interesting to do
+        Ooops("No prefix matches $1", what);
+        return encloseResult(context, frame->original, what);
+    }
 
-        case NAME:
-            Ooops("No name matches $1", what);
-            return encloseResult(context, originalScope, what);
+    case Frame::ARGUMENT:
+    {
+        // Both callee and argument were evaluated, retry with them
+        Prefix *pfx = (Prefix *) (Tree *) what;
+        Tree *newCallee = frame->callee;
+        Tree *arg = frame->value;
 
-        case BLOCK:
+        // We built a new context if left was a block
+        if (Tree *inside = IsClosure(newCallee, &context))
         {
-            // Evaluate child in a new context
-            context->CreateScope();
-            what = ((Block *) (Tree *) what)->child;
-            bool hasInstructions = context->ProcessDeclarations(what);
-            if (context->IsEmpty())
-                context->PopScope();
-            if (hasInstructions)
-                continue;
-            return encloseResult(context, originalScope, what);
+            what = arg;
+            // Check if we have a single definition on the left
+            if (Infix *ifx = inside->AsInfix())
+                if (ifx->name == symArrow)
+                    what = new Prefix(newCallee, arg, pfx->Position());
         }
+        else
+        {
+            // Other more regular cases
+            what = new Prefix(newCallee, arg, pfx->Position());
+        }
+        break;
+    }
+
+    case Frame::LOOKUP:
+        // The argument a lookup needed is in the cache, retry the lookup
+        frame->cache[frame->pending] = frame->value;
+        frame->retry = true;
+        break;
+    }
+    frame->value = NULL;
+
+    if (!what)
+        return encloseResult(context, frame->original, frame->result);
+
+    // First attempt to look things up
+    if (frame->retry)
+        frame->retry = false;
+    else
+        frame->cache.clear();
+    frame->pending = NULL;
+    frame->pendingContext = NULL;
 
-        case PREFIX:
+    Errors *errors = MAIN->errors;
+    frame->errors = errors->errors.size();
+    frame->contextErrors = errors->context;
+    if (Tree *eval = context->Lookup(what, evalLookup, frame))
+    {
+        if (frame->pending)
         {
-            // If we have a prefix on the left, check if it's a closure
-            if (Tree *closed = IsClosure(what, &context))
+            // Drop errors from candidates that will be tried again
+            if (errors->errors.size() > frame->errors)
             {
-                what = closed;
-                continue;
+                errors->errors.erase(errors->errors.begin() + frame->errors,
+                                     errors->errors.end());
+                errors->context = frame->contextErrors;
             }
+            frame->wait = Frame::LOOKUP;
+            Push(frame->pendingContext, frame->pending, depth + 1, true);
+            frame->pendingContext = NULL;
+            return NULL;
+        }
+
+        if (eval == eliot_error)
+            return eval;
+        MAIN->errors->Clear();
+        frame->result = eval;
+        if (Tree *inside = IsClosure(eval, &context))
+        {
+            what = inside;
+            return NULL;
+        }
+        return encloseResult(context, frame->original, eval);
+    }
+
+    kind whatK = what->Kind();
+    switch (whatK)
+    {
+    case INTEGER:
+    case REAL:
+    case TEXT:
+        return what;
+
+    case NAME:
+        Ooops("No name matches $1", what);
+        return encloseResult(context, frame->original, what);
+
+    case BLOCK:
+    {
+        // Evaluate child in a new context
+        context->CreateScope();
+        what = ((Block *) (Tree *) what)->child;
+        bool hasInstructions = context->ProcessDeclarations(what);
+        if (context->IsEmpty())
+            context->PopScope();
+        if (hasInstructions)
+            return NULL;
+        return encloseResult(context, frame->original, what);
+    }
+
+    case PREFIX:
+    {
+        // If we have a prefix on the left, check if it's a closure
+        if (Tree *closed = IsClosure(what, &context))
+        {
+            what = closed;
+            return NULL;
+        }
 
-            // If we have a name on the left, lookup name and start again
-            Prefix *pfx = (Prefix *) (Tree *) what;
-            Tree   *callee = pfx->left;
+        // If we have a name on the left, lookup name and start again
+        Prefix *pfx = (Prefix *) (Tree *) what;
+        Tree   *callee = pfx->left;
 
-            // Check if we had something like '(X->X+1) 31' as closure
-            Context_p calleeContext = NULL;
-            if (Tree *inside = IsClosure(callee, &calleeContext))
-                callee = inside;
+        // Check if we had something like '(X->X+1) 31' as closure
+        Context_p calleeContext = NULL;
+        if (Tree *inside = IsClosure(callee, &calleeContext))
+            callee = inside;
 
-            if (Name *name = callee->AsName())
-                // A few cases where we don't interpret the result
-                if (name->value == "type"   ||
-                    name->value == "extern" ||
-                    name->value == "data")
-                    return what;
+        if (Name *name = callee->AsName())
+            // A few cases where we don't interpret the result
+            if (name->value == "type"   ||
+                name->value == "extern" ||
+                name->value == "data")
+                return what;
 
-            // This variable records if we evaluated the callee
-            Tree *newCallee = NULL;
-            Tree *arg = pfx->right;
+        Tree *arg = pfx->right;
 
-            // If we have an infix on the left, check if it's a single rewrite
-            if (Infix *lifx = callee->AsInfix())
+        // If we have an infix on the left, check if it's a single rewrite
+        if (Infix *lifx = callee->AsInfix())
+        {
+            // Check if we have a function definition
+            if (lifx->name == symArrow)
             {
-                // Check if we have a function definition
-                if (lifx->name == "->")
+                // If we have a single name on the left, like (X->X+1)
+                // interpret that as a lambda function
+                if (Name *lfname = lifx->left->AsName())
                 {
-                    // If we have a single name on the left, like (X->X+1)
-                    // interpret that as a lambda function
-                    if (Name *lfname = lifx->left->AsName())
-                    {
-                        // Case like '(X->X+1) Arg':
-                        // Bind arg in new context and evaluate body
-                        context = new Context(context);
-                        context->Define(lfname, arg);
-                        what = lifx->right;
-                        continue;
-                    }
-
-                    // Otherwise, enter declaration and retry, e.g.
-                    // '(X,Y->X+Y) (2,3)' should evaluate as 5
+                    // Case like '(X->X+1) Arg':
+                    // Bind arg in new context and evaluate body
                     context = new Context(context);
-                    context->Define(lifx->left, lifx->right);
-                    what = arg;
-                    continue;
+                    context->Define(lfname, arg);
+                    what = lifx->right;
+                    return NULL;
                 }
-            }
 
-            // Other cases: evaluate the callee, and if it changed, retry
-            if (!newCallee)
-            {
-                Context_p newContext = new Context(context);
-                newCallee = EvaluateClosure(newContext, callee);
+                // Otherwise, enter declaration and retry, e.g.
+                // '(X,Y->X+Y) (2,3)' should evaluate as 5
+                context = new Context(context);
+                context->Define(lifx->left, lifx->right);
+                what = arg;
+                return NULL;
             }
+        }
 
-            if (newCallee != callee)
-            {
-                // We need to evaluate argument in current context
-                arg = Instructions(context, arg);
+        // Other cases: evaluate the callee, and if it changed, retry
+        frame->callee = callee;
+        frame->wait = Frame::CALLEE;
+        Push(new Context(context), callee, depth, true);
+        return NULL;
+    }
 
-                // We built a new context if left was a block
-                if (Tree *inside = IsClosure(newCallee, &context))
-                {
-                    what = arg;
-                    // Check if we have a single definition on the left
-                    if (Infix *ifx = inside->AsInfix())
-                        if (ifx->name == "->")
-                            what = new Prefix(newCallee, arg, pfx->Position());
-                }
-                else
-                {
-                    // Other more regular cases
-                    what = new Prefix(newCallee, arg, pfx->Position());
-                }
-                continue;
-            }
+    case POSTFIX:
+    {
+        // Check if there is a form that matches
+        Ooops("No postifx matches $1", what);
+        return encloseResult(context, frame->original, what);
+    }
 
-            // If we get there, we didn't find anything interesting to do
-            Ooops("No prefix matches $1", what);
-            return encloseResult(context, originalScope, what);
-        }
+    case INFIX:
+    {
+        Infix *infix = (Infix *) (Tree *) what;
+        Symbol name = infix->name;
 
-        case POSTFIX:
+        // Check sequences
+        if (name == symSequence || name == symNewline)
         {
-            // Check if there is a form that matches
-            Ooops("No postifx matches $1", what);
-            return encloseResult(context, originalScope, what);
+            // Sequences: evaluate left, then right
+            frame->wait = Frame::SEQUENCE;
+            Push(context, infix->left, depth, false);
+            return NULL;
         }
 
-        case INFIX:
+        // Check declarations
+        if (name == symArrow)
         {
-            Infix *infix = (Infix *) (Tree *) what;
-            text name = infix->name;
-
-            // Check sequences
-            if (name == ";" || name == "\n")
-            {
-                // Sequences: evaluate left, then right
-                Context *leftContext = context;
-                Tree *left = Instructions(leftContext, infix->left);
-                if (left != infix->left)
-                    result = left;
-                what = infix->right;
-                continue;
-            }
-
-            // Check declarations
-            if (name == "->")
-            {
-                // Declarations evaluate last non-declaration result, or self
-                return encloseResult(context, originalScope, result);
-            }
-
-            // Check type matching
-            if (name == "as")
-            {
-                result = TypeCheck(context, infix->right, infix->left);
-                if (!result)
-                {
-                    Ooops("Value $1 does not match type $2",
-                          infix->left, infix->right);
-                    result = infix->left;
-                }
-                return encloseResult(context, originalScope, result);
-            }
+            // Declarations evaluate last non-declaration result, or self
+            return encloseResult(context, frame->original, frame->result);
+        }
 
-            // Check scoped reference
-            if (name == ".")
+        // Check type matching
+        if (name == symAs)
+        {
+            Tree *result = TypeCheck(context, infix->right, infix->left);
+            if (!result)
             {
-                Tree *left = Instructions(context, infix->left);
-                IsClosure(left, &context);
-                what = infix->right;
-                continue;
+                Ooops("Value $1 does not match type $2",
+                      infix->left, infix->right);
+                result = infix->left;
             }
+            return encloseResult(context, frame->original, result);
+        }
 
-            // All other cases: failure
-            Ooops("No infix matches $1", what);
-            return encloseResult(context, originalScope, what);
+        // Check scoped reference
+        if (name == symScope)
+        {
+            frame->wait = Frame::SCOPED;
+            Push(context, infix->left, depth, false);
+            return NULL;
         }
-        } // switch
-    }// while(what)
 
-    return encloseResult(context, originalScope, result);
+        // All other cases: failure
+        Ooops("No infix matches $1", what);
+        return encloseResult(context, frame->original, what);
+    }
+    } // switch
+
+    return NULL;
 }
 
 
@@ -830,17 +1171,8 @@ Tree *EvaluateClosure(Context *context, Tree *what)
 //    Evaluate 'what', possibly returned as a closure in case not in 'context'
 // ----------------------------------------------------------------------------
 {
-    // Create scope for declarations, and evaluate in this context
-    Tree_p result = what;
-    Errors *errors = MAIN->errors;
-    uint errCount = errors->Count();
-    if (context->ProcessDeclarations(what) && errCount == errors->Count())
-        result = Instructions(context, what);
-
-    // This is a safe point for checking collection status
-    GarbageCollector::SafePoint();
-
-    return result;
+    Evaluator evaluator(context, what);
+    return evaluator.Run();
 }
 
 
@@ -901,7 +1233,8 @@ struct Expansion
     }
     Tree *  DoInfix(Infix *what)
     {
-        if (what->name == ":" || what->name == "as" || what->name == "when")
+        if (what->name == symColon || what->name == symAs ||
+            what->name == symWhen)
             return what->left->Do(this);
         Tree *left  = what->left->Do(this);
         Tree *right = what->right->Do(this);
@@ -22,6 +22,7 @@
 
 #include "tree.h"
 #include "context.h"
+#include <vector>
 
 
 ELIOT_BEGIN
@@ -59,11 +60,43 @@ Opcode *OpcodeInfo(Infix *decl);
 //
 // ============================================================================
 
-struct ClosureInfo : Info
+struct Closure : Prefix
 // ----------------------------------------------------------------------------
-//   Mark a given Prefix as a closure
+//   A value together with the scope it must be evaluated in
 // ----------------------------------------------------------------------------
-{};
+//   The captured scope is on the left and the value on the right, so that
+//   the closure is itself a scope whose parent is the captured scope.
+//   Closures have their own allocator and are marked in the tree tag.
+{
+    Closure(Scope *scope, Tree *value): Prefix(scope, value)
+    {
+        tag |= CLOSURE;
+    }
+    GARBAGE_COLLECT(Closure);
+};
+typedef GCPtr<Closure> Closure_p;
+
+
+inline Closure *AsClosure(Tree *tree)
+// ----------------------------------------------------------------------------
+//   Return the tree as a closure if it is one
+// ----------------------------------------------------------------------------
+{
+    if (tree->tag & Tree::CLOSURE)
+        return (Closure *) tree;
+    return NULL;
+}
+
+
+struct TierInfo : Info
+// ----------------------------------------------------------------------------
+//   Count evaluations at -O2 to decide when to compile
+// ----------------------------------------------------------------------------
+{
+    TierInfo(): count(0), failed(false) {}
+    uint        count;
+    bool        failed;         // Could not be compiled, stay interpreted
+};
 
 
 inline Tree *IsClosure(Tree *tree, Context_p *context)
@@ -71,18 +104,11 @@ inline Tree *IsClosure(Tree *tree, Context_p *context)
 //   Check if something is a closure, if so set scope and/or context
 // ----------------------------------------------------------------------------
 {
-    if (Scope *closure = tree->AsPrefix())
+    if (Closure *closure = AsClosure(tree))
     {
-        if (Scope *scope = ScopeParent(closure))
-        {
-            if (closure->GetInfo<ClosureInfo>())
-            {
-                // We normally have a scope on the left
-                if (context)
-                    *context = new Context(scope);
-                return closure->right;
-            }
-        }
+        if (context)
+            *context = new Context(ScopeParent(closure));
+        return closure->right;
     }
     return NULL;
 }
@@ -120,20 +146,56 @@ retry:
             }
         }
 
-        if (valueKind != PREFIX || !value->GetInfo<ClosureInfo>())
-        {
-            Scope *scope = context->CurrentScope();
-            value = new Prefix(scope, value);
-
-            ClosureInfo *closureMarker = new ClosureInfo;
-            value->SetInfo(closureMarker);
-        }
+        if (!AsClosure(value))
+            value = new Closure(context->CurrentScope(), value);
     }
     return value;
 }
 
 
 
+// ============================================================================
+//
+//    Evaluation stack
+//
+// ============================================================================
+
+struct Frame;
+
+struct Evaluator
+// ----------------------------------------------------------------------------
+//   Evaluate a tree with an explicit stack of continuation frames
+// ----------------------------------------------------------------------------
+//   Pending evaluations are frames on the heap rather than C calls, so that
+//   deep recursion is bounded by memory. Run(steps) may stop in the middle
+//   of an evaluation, and a later call to Run resumes where it stopped.
+{
+    enum { SAFE_POINT_FRAMES = 16 };    // Completed frames between GC checks
+
+    Evaluator(Context *context, Tree *what);
+    ~Evaluator();
+
+    Tree *              Run(uint steps = 0);
+    bool                Done()          { return frames.empty(); }
+    Tree *              Result()        { return result; }
+
+private:
+    void                Push(Context *context, Tree *what,
+                             uint depth, bool closure);
+    Tree *              Step(Frame *frame);
+
+public:
+    std::vector<Frame *>frames;
+    Tree_p              result;
+    Tree_p              error;          // Sticky error, e.g. stack overflow
+    uint                depth;          // Depth of the current lookup
+    uint                nested;         // Evaluators below on the C stack
+    uint                completed;      // Closure frames completed so far
+    static Evaluator *  current;
+};
+
+
+
 // ============================================================================
 // 
 //    Inline implementations for main entry points
@@ -0,0 +1,6 @@
+#include "runtime.h"
+#include "io-module.h"
+#include "opcodes.h"
+ELIOT_BEGIN
+#include "io.tbl"
+ELIOT_END
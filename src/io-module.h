@@ -0,0 +1,8 @@
+#ifndef IO_MODULE_H
+#define IO_MODULE_H
+#define TBL_HEADER
+#include "opcodes.h"
+ELIOT_BEGIN
+#include "io.tbl"
+ELIOT_END
+#endif // IO_MODULE_H
@@ -51,6 +51,8 @@
 #include "options.h"
 #include "basics.h"
 #include "serializer.h"
+#include "image.h"
+#include "memo.h"
 #include "runtime.h"
 #include "traces.h"
 #include "flight_recorder.h"
@@ -58,6 +60,7 @@
 #include "interpreter.h"
 #include "opcodes.h"
 #include "remote.h"
+#include "bytecode.h"
 
 #ifndef INTERPRETER_ONLY
 #include "args.h"
@@ -153,6 +156,9 @@ Main::Main(int inArgc, char **inArgv, text compilerName,
     MAIN = this;
     options.builtins = builtinsName;
     ParseOptions();
+    TypeAllocator::deferred = options.deferred_rc;
+    if (options.profile)
+        Profiler::profiler = new Profiler;
     FlightRecorder::SResize(options.flightRecorderSize);
     if (options.flightRecorderFlags)
         FlightRecorder::SFlags(options.flightRecorderFlags);
@@ -314,6 +320,11 @@ int Main::LoadFile(text file, text modname)
         }
     }
 
+    // Check if we have an up-to-date precompiled image of the file
+    bool useImage = file != "-" && !options.crypted && !options.packed;
+    if (!tree && useImage && options.images && !options.write_image)
+        tree = Image::Load(file, positions);
+
     // Read in standard format if we could not read it from packed format
     if (!tree)
     {
@@ -321,8 +332,14 @@ int Main::LoadFile(text file, text modname)
         kstring errName = file.c_str();
         if (file == "-")
             errName = "<stdin>";
+        uint errCount = topLevelErrors.Count();
         Parser parser (*input, syntax, positions, topLevelErrors, errName);
         tree = parser.Parse();
+
+        // Write the image if requested, unless the file changed the syntax
+        if (tree && useImage && options.write_image &&
+            !parser.HadSyntax() && topLevelErrors.Count() == errCount)
+            Image::Save(file, tree, positions);
     }
 
     // If at this stage we don't have a tree, this is an error
@@ -374,6 +391,7 @@ int Main::LoadFile(text file, text modname)
     // Create new symbol table for the file
     Context *parent = MAIN->context;
     Context *ctx = new Context(parent, tree->Position());
+    LookupCache::Enable(ctx->CurrentScope());
 
     // Set the module path, directory and file
     ctx->SetModulePath(file);
@@ -603,7 +621,21 @@ int main(int argc, char **argv)
     int rc = main.LoadAndRun();
 
     IFTRACE(gcstats)
+    {
         ELIOT::GarbageCollector::GC()->PrintStatistics();
+        printf("%24s %8lu reused %8lu escaped\n", "Lookup contexts",
+               ELIOT::PooledContext::reused, ELIOT::PooledContext::escaped);
+        ELIOT::LookupCache::PrintStatistics();
+    }
+    IFTRACE(memo)
+        ELIOT::Memo::PrintStatistics();
+    if (main.options.dump_ops)
+        ELIOT::Code::DumpPeephole(std::cerr);
+    if (ELIOT::Profiler *profiler = ELIOT::Profiler::profiler)
+    {
+        std::ofstream json(main.options.profile_output.c_str());
+        profiler->Dump(std::cerr, json);
+    }
 
 #if CONFIG_USE_SBRK
     IFTRACE(memory)
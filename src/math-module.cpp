@@ -0,0 +1,6 @@
+#include "runtime.h"
+#include "math-module.h"
+#include "opcodes.h"
+ELIOT_BEGIN
+#include "math.tbl"
+ELIOT_END
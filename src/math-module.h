@@ -0,0 +1,8 @@
+#ifndef MATH_MODULE_H
+#define MATH_MODULE_H
+#define TBL_HEADER
+#include "opcodes.h"
+ELIOT_BEGIN
+#include "math.tbl"
+ELIOT_END
+#endif // MATH_MODULE_H
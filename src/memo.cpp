@@ -0,0 +1,229 @@
+// ****************************************************************************
+//  memo.cpp                                                      ELIOT project
+// ****************************************************************************
+//
+//   File Description:
+//
+//     Bounded cache of results for rewrites declared as 'memo'
+//
+//
+//
+//
+//
+//
+//
+// ****************************************************************************
+//  (C) 2015 Christophe de Dinechin <christophe@taodyne.com>
+//  (C) 2015 Taodyne SAS
+// ****************************************************************************
+
+#include "memo.h"
+#include "context.h"
+#include "main.h"
+
+#include <stdio.h>
+
+
+ELIOT_BEGIN
+
+// ============================================================================
+//
+//   Statistics shared by all memoized declarations
+//
+// ============================================================================
+
+ulong Memo::totalHits      = 0;
+ulong Memo::totalMisses    = 0;
+ulong Memo::totalEvictions = 0;
+uint  Memo::declarations   = 0;
+
+
+void Memo::PrintStatistics()
+// ----------------------------------------------------------------------------
+//   Print the cache statistics, in the same format as the GC statistics
+// ----------------------------------------------------------------------------
+{
+    ulong total = totalHits + totalMisses;
+    printf("%24s %8s %8s %8s %8s %8s\n",
+           "MEMO", "DECLS", "CALLS", "HITS", "MISSES", "EVICTED");
+    printf("%24s %8u %8lu %8lu %8lu %8lu\n",
+           "Memoized rewrites", declarations,
+           total, totalHits, totalMisses, totalEvictions);
+    if (total)
+        printf("%24s %7lu%%\n", "Hit rate", totalHits * 100 / total);
+}
+
+
+
+// ============================================================================
+//
+//   Hashing and lookup of argument lists
+//
+// ============================================================================
+
+ulong Memo::Hash(Tree *what)
+// ----------------------------------------------------------------------------
+//   Structural hash, consistent with Tree::Equal
+// ----------------------------------------------------------------------------
+{
+    ulong h = Context::Hash(what);
+    switch(what->Kind())
+    {
+    case BLOCK:
+        h = h * 31 + Hash(((Block *) what)->child);
+        break;
+    case PREFIX:
+        h = h * 31 + Hash(((Prefix *) what)->left);
+        h = h * 31 + Hash(((Prefix *) what)->right);
+        break;
+    case POSTFIX:
+        h = h * 31 + Hash(((Postfix *) what)->left);
+        h = h * 31 + Hash(((Postfix *) what)->right);
+        break;
+    case INFIX:
+        h = h * 31 + Hash(((Infix *) what)->left);
+        h = h * 31 + Hash(((Infix *) what)->right);
+        break;
+    default:
+        break;
+    }
+    return h;
+}
+
+
+ulong Memo::Hash(TreeList &args)
+// ----------------------------------------------------------------------------
+//   Combine the hash of all arguments
+// ----------------------------------------------------------------------------
+{
+    ulong h = 0xC0DED + args.size();
+    for (TreeList::iterator a = args.begin(); a != args.end(); a++)
+        h = h * 0x29912837 + Hash(*a);
+    return h;
+}
+
+
+bool Memo::Cacheable(TreeList &args)
+// ----------------------------------------------------------------------------
+//   Check if all arguments are constants, i.e. can't depend on the caller
+// ----------------------------------------------------------------------------
+{
+    for (TreeList::iterator a = args.begin(); a != args.end(); a++)
+        if ((*a)->Kind() >= NAME)
+            return false;
+    return true;
+}
+
+
+static bool sameArguments(TreeList &args, TreeList &cached)
+// ----------------------------------------------------------------------------
+//   Check if two argument lists are structurally identical
+// ----------------------------------------------------------------------------
+{
+    uint max = args.size();
+    if (cached.size() != max)
+        return false;
+    for (uint a = 0; a < max; a++)
+        if (!Tree::Equal(args[a], cached[a]))
+            return false;
+    return true;
+}
+
+
+Tree *Memo::Find(TreeList &args)
+// ----------------------------------------------------------------------------
+//   Return the cached value for the arguments, or NULL on a miss
+// ----------------------------------------------------------------------------
+{
+    ulong h = Hash(args);
+    std::pair<Index::iterator, Index::iterator> range = index.equal_range(h);
+    for (Index::iterator i = range.first; i != range.second; i++)
+    {
+        Entries::iterator entry = (*i).second;
+        if (sameArguments(args, (*entry).args))
+        {
+            // Move the entry to the front to mark it as recently used
+            entries.splice(entries.begin(), entries, entry);
+            hits++;
+            totalHits++;
+            return (*entry).value;
+        }
+    }
+    misses++;
+    totalMisses++;
+    return NULL;
+}
+
+
+void Memo::Enter(TreeList &args, Tree *value)
+// ----------------------------------------------------------------------------
+//   Record a constant value, evicting the least recently used entry if full
+// ----------------------------------------------------------------------------
+{
+    if (!value || value->Kind() >= NAME)
+        return;
+
+    uint max = MAIN->options.memo_size;
+    if (!max)
+        return;
+    while (entries.size() >= max)
+    {
+        Entries::iterator last = --entries.end();
+        std::pair<Index::iterator, Index::iterator> range =
+            index.equal_range((*last).hash);
+        for (Index::iterator i = range.first; i != range.second; i++)
+        {
+            if ((*i).second == last)
+            {
+                index.erase(i);
+                break;
+            }
+        }
+        entries.erase(last);
+        evictions++;
+        totalEvictions++;
+    }
+
+    Entry entry;
+    entry.hash = Hash(args);
+    entry.args = args;
+    entry.value = value;
+    entries.push_front(entry);
+    index.insert(Index::value_type(entry.hash, entries.begin()));
+}
+
+
+
+// ============================================================================
+//
+//   Finding the memoization cache for a declaration
+//
+// ============================================================================
+
+Memo *MemoInfo(Infix *decl)
+// ----------------------------------------------------------------------------
+//    Check if the definition is memoized, e.g. 'X -> memo Body'
+// ----------------------------------------------------------------------------
+{
+    Tree *right = decl->right;
+    Memo *info = right->GetInfo<Memo>();
+    if (info)
+        return info;
+
+    if (Prefix *prefix = right->AsPrefix())
+    {
+        if (Name *name = prefix->left->AsName())
+        {
+            if (name->value == "memo")
+            {
+                info = new Memo(prefix->right);
+                right->SetInfo<Memo>(info);
+                Memo::declarations++;
+                return info;
+            }
+        }
+    }
+    return NULL;
+}
+
+ELIOT_END
@@ -0,0 +1,84 @@
+#ifndef MEMO_H
+#define MEMO_H
+// ****************************************************************************
+//  memo.h                                                        ELIOT project
+// ****************************************************************************
+//
+//   File Description:
+//
+//     Bounded cache of results for rewrites declared as 'memo'
+//
+//
+//
+//
+//
+//
+//
+// ****************************************************************************
+//  (C) 2015 Christophe de Dinechin <christophe@taodyne.com>
+//  (C) 2015 Taodyne SAS
+// ****************************************************************************
+//
+//   A rewrite is memoized when its body is written as 'memo Body', e.g.
+//       fib N:integer -> memo (if N <= 1 then N else fib(N-1) + fib(N-2))
+//   The result of each call is then recorded in a cache attached to the
+//   declaration, keyed on a structural hash of the bound arguments.
+//   The cache holds at most -memo entries, and the least recently used
+//   entry is evicted first.
+//
+//   Only calls where all arguments are constants are cached, and only
+//   constant results are recorded. Other arguments may be lazy closures
+//   that depend on the caller's scope, and are evaluated normally.
+
+#include "tree.h"
+#include <list>
+#include <map>
+
+
+ELIOT_BEGIN
+
+struct Memo : Info
+// ----------------------------------------------------------------------------
+//   The memoization cache for a given declaration
+// ----------------------------------------------------------------------------
+{
+    struct Entry
+    {
+        ulong           hash;
+        TreeList        args;
+        Tree_p          value;
+    };
+    typedef std::list<Entry>                    Entries;
+    typedef std::multimap<ulong, Entries::iterator> Index;
+
+    Memo(Tree *body): body(body), entries(), index(),
+                      hits(0), misses(0), evictions(0) {}
+
+    Tree *              Find(TreeList &args);
+    void                Enter(TreeList &args, Tree *value);
+
+    static bool         Cacheable(TreeList &args);
+    static ulong        Hash(Tree *what);
+    static ulong        Hash(TreeList &args);
+    static void         PrintStatistics();
+
+public:
+    Tree_p              body;           // Body to evaluate on a miss
+    Entries             entries;        // Most recently used first
+    Index               index;          // Entries by hash of the arguments
+    ulong               hits;
+    ulong               misses;
+    ulong               evictions;
+
+    static ulong        totalHits;
+    static ulong        totalMisses;
+    static ulong        totalEvictions;
+    static uint         declarations;
+};
+
+
+Memo *MemoInfo(Infix *decl);
+
+ELIOT_END
+
+#endif // MEMO_H
@@ -83,6 +83,7 @@ token_t Parser::NextToken()
             if (opening == "syntax")
             {
                 syntax.ReadSyntaxFile(scanner, 0);
+                hadSyntax = true;
                 continue;
             }
             else if (syntax.IsComment(opening, closing))
@@ -0,0 +1,7 @@
+#include "runtime.h"
+#include "remote-module.h"
+#include "opcodes.h"
+#include "remote.cpp"
+ELIOT_BEGIN
+#include "remote.tbl"
+ELIOT_END
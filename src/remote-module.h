@@ -0,0 +1,9 @@
+#ifndef REMOTE_MODULE_H
+#define REMOTE_MODULE_H
+#define TBL_HEADER
+#include "opcodes.h"
+#include "remote.h"
+ELIOT_BEGIN
+#include "remote.tbl"
+ELIOT_END
+#endif // REMOTE_MODULE_H
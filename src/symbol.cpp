@@ -0,0 +1,129 @@
+// ****************************************************************************
+//  symbol.cpp                                                    ELIOT project
+// ****************************************************************************
+//
+//   File Description:
+//
+//     Interned symbols for the values of names and the names of infixes
+//
+//
+//
+//
+//
+//
+//
+// ****************************************************************************
+//  (C) 2015 Christophe de Dinechin <christophe@taodyne.com>
+//  (C) 2015 Taodyne SAS
+// ****************************************************************************
+
+#include "symbol.h"
+#include <vector>
+
+
+ELIOT_BEGIN
+
+// ============================================================================
+//
+//   The global table of atoms
+//
+// ============================================================================
+
+struct AtomTable
+// ----------------------------------------------------------------------------
+//   Open-addressing hash table of all atoms, never shrinks
+// ----------------------------------------------------------------------------
+{
+    enum { MIN_SLOTS = 1024 };
+
+    AtomTable(): slots(MIN_SLOTS), count(0) {}
+
+    Atom *Intern(const text &t)
+    {
+        ulong hash = TextHash(t);
+        uint  mask = slots.size() - 1;
+        uint  slot = (hash ^ (hash >> 16)) & mask;
+        while (Atom *atom = slots[slot])
+        {
+            if (atom->hash == hash && atom->value == t)
+                return atom;
+            slot = (slot + 1) & mask;
+        }
+
+        Atom *atom = new Atom;
+        atom->value = t;
+        atom->hash = hash;
+        slots[slot] = atom;
+        if (2 * ++count > slots.size())
+            Grow();
+        return atom;
+    }
+
+    void Grow()
+    {
+        std::vector<Atom *> old;
+        old.swap(slots);
+        slots.resize(2 * old.size());
+        uint mask = slots.size() - 1;
+        for (uint i = 0; i < old.size(); i++)
+        {
+            if (Atom *atom = old[i])
+            {
+                uint slot = (atom->hash ^ (atom->hash >> 16)) & mask;
+                while (slots[slot])
+                    slot = (slot + 1) & mask;
+                slots[slot] = atom;
+            }
+        }
+    }
+
+    std::vector<Atom *> slots;
+    uint                count;
+};
+
+
+static AtomTable &Atoms()
+// ----------------------------------------------------------------------------
+//   Return the table, created on first use so that static symbols work
+// ----------------------------------------------------------------------------
+{
+    static AtomTable *atoms = new AtomTable;
+    return *atoms;
+}
+
+
+Atom *Symbol::Intern(const text &t)
+// ----------------------------------------------------------------------------
+//   Return the unique atom for the spelling, creating it if necessary
+// ----------------------------------------------------------------------------
+{
+    return Atoms().Intern(t);
+}
+
+
+uint Symbol::Count()
+// ----------------------------------------------------------------------------
+//   Return the number of distinct spellings interned so far
+// ----------------------------------------------------------------------------
+{
+    return Atoms().count;
+}
+
+
+
+// ============================================================================
+//
+//   Predefined symbols
+//
+// ============================================================================
+
+Symbol symArrow("->");
+Symbol symSequence(";");
+Symbol symNewline("\n");
+Symbol symAs("as");
+Symbol symColon(":");
+Symbol symScope(".");
+Symbol symWhen("when");
+Symbol symComma(",");
+
+ELIOT_END
@@ -0,0 +1,168 @@
+#ifndef SYMBOL_H
+#define SYMBOL_H
+// ****************************************************************************
+//  symbol.h                                                      ELIOT project
+// ****************************************************************************
+//
+//   File Description:
+//
+//     Interned symbols for the values of names and the names of infixes
+//
+//
+//
+//
+//
+//
+//
+// ****************************************************************************
+//  (C) 2015 Christophe de Dinechin <christophe@taodyne.com>
+//  (C) 2015 Taodyne SAS
+// ****************************************************************************
+//
+//   Each distinct spelling is stored once in a global table of atoms,
+//   which are never freed. A Symbol is a pointer to an atom, so that
+//   comparing two symbols is a pointer comparison, and copying one does
+//   not allocate. The atom also records the hash of the spelling.
+//
+//   Symbols convert to 'const text &' and have the usual read-only text
+//   members, so that code reading them can treat them as text.
+//   Comparing with a literal compares characters. In hot paths, compare
+//   with one of the predefined symbols below instead.
+
+#include "base.h"
+#include <string.h>
+#include <iostream>
+
+
+ELIOT_BEGIN
+
+inline ulong TextHash(const text &t)
+// ----------------------------------------------------------------------------
+//   Full-length hash of a text (FNV-1a), cached in texts and symbols
+// ----------------------------------------------------------------------------
+{
+    ulonglong h = 0xCBF29CE484222325ULL;
+    kstring   ptr = t.data();
+    uint      l = t.length();
+    for (uint i = 0; i < l; i++)
+    {
+        h ^= (byte) ptr[i];
+        h *= 0x100000001B3ULL;
+    }
+    return ulong(h ^ (h >> 32));
+}
+
+
+struct Atom
+// ----------------------------------------------------------------------------
+//   The unique representation of a spelling
+// ----------------------------------------------------------------------------
+{
+    text                value;
+    ulong               hash;
+};
+
+
+struct Symbol
+// ----------------------------------------------------------------------------
+//   A handle on an interned spelling
+// ----------------------------------------------------------------------------
+{
+    Symbol(): atom(Intern(text())) {}
+    Symbol(const text &t): atom(Intern(t)) {}
+    Symbol(kstring t): atom(Intern(text(t))) {}
+
+    Symbol &            operator=(const text &t) { atom = Intern(t); return *this; }
+    Symbol &            operator=(kstring t)  { atom = Intern(text(t)); return *this; }
+    operator const text &() const       { return atom->value; }
+    const text &        Value() const   { return atom->value; }
+    ulong               Hash() const    { return atom->hash; }
+
+    // Read-only text interface
+    typedef text::size_type size_type;
+    size_type           length() const  { return atom->value.length(); }
+    size_type           size() const    { return atom->value.size(); }
+    bool                empty() const   { return atom->value.empty(); }
+    kstring             c_str() const   { return atom->value.c_str(); }
+    kstring             data() const    { return atom->value.data(); }
+    char                operator[](size_type i) const { return atom->value[i]; }
+    text                substr(size_type p = 0, size_type n = text::npos) const
+    {
+        return atom->value.substr(p, n);
+    }
+    size_type           find(const text &t, size_type p = 0) const
+    {
+        return atom->value.find(t, p);
+    }
+    size_type           find(kstring t, size_type p = 0) const
+    {
+        return atom->value.find(t, p);
+    }
+    size_type           find(char c, size_type p = 0) const
+    {
+        return atom->value.find(c, p);
+    }
+    size_type           rfind(const text &t, size_type p = text::npos) const
+    {
+        return atom->value.rfind(t, p);
+    }
+    size_type           rfind(char c, size_type p = text::npos) const
+    {
+        return atom->value.rfind(c, p);
+    }
+    text::const_iterator begin() const  { return atom->value.begin(); }
+    text::const_iterator end() const    { return atom->value.end(); }
+
+    // Comparisons
+    bool operator==(const Symbol &o) const { return atom == o.atom; }
+    bool operator!=(const Symbol &o) const { return atom != o.atom; }
+    bool operator==(const text &t) const   { return atom->value == t; }
+    bool operator!=(const text &t) const   { return atom->value != t; }
+    bool operator==(kstring t) const       { return !strcmp(c_str(), t); }
+    bool operator!=(kstring t) const       { return strcmp(c_str(), t); }
+    bool operator< (const Symbol &o) const { return atom->value <  o.Value(); }
+    bool operator> (const Symbol &o) const { return atom->value >  o.Value(); }
+    bool operator<=(const Symbol &o) const { return atom->value <= o.Value(); }
+    bool operator>=(const Symbol &o) const { return atom->value >= o.Value(); }
+
+    static Atom *       Intern(const text &t);
+    static uint         Count();
+
+private:
+    Atom *              atom;
+};
+
+
+// Comparisons and concatenation with text on the left
+inline bool operator==(const text &t, const Symbol &s)  { return s == t; }
+inline bool operator!=(const text &t, const Symbol &s)  { return s != t; }
+inline bool operator==(kstring t, const Symbol &s)      { return s == t; }
+inline bool operator!=(kstring t, const Symbol &s)      { return s != t; }
+
+inline text operator+(const Symbol &s, const text &t)   { return s.Value()+t; }
+inline text operator+(const text &t, const Symbol &s)   { return t+s.Value(); }
+inline text operator+(const Symbol &s, kstring t)       { return s.Value()+t; }
+inline text operator+(kstring t, const Symbol &s)       { return t+s.Value(); }
+inline text operator+(const Symbol &s, char c)          { return s.Value()+c; }
+inline text operator+(char c, const Symbol &s)          { return c+s.Value(); }
+inline text operator+(const Symbol &s, const Symbol &o) { return s.Value()+o.Value(); }
+
+inline std::ostream &operator<<(std::ostream &out, const Symbol &s)
+{
+    return out << s.Value();
+}
+
+
+// Symbols compared in hot paths
+extern Symbol symArrow;         // ->
+extern Symbol symSequence;      // ;
+extern Symbol symNewline;       // \n
+extern Symbol symAs;            // as
+extern Symbol symColon;         // :
+extern Symbol symScope;         // .
+extern Symbol symWhen;          // when
+extern Symbol symComma;         // ,
+
+ELIOT_END
+
+#endif // SYMBOL_H
@@ -0,0 +1,6 @@
+#include "runtime.h"
+#include "temperature-module.h"
+#include "opcodes.h"
+ELIOT_BEGIN
+#include "temperature.tbl"
+ELIOT_END
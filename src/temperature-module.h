@@ -0,0 +1,8 @@
+#ifndef TEMPERATURE_MODULE_H
+#define TEMPERATURE_MODULE_H
+#define TBL_HEADER
+#include "opcodes.h"
+ELIOT_BEGIN
+#include "temperature.tbl"
+ELIOT_END
+#endif // TEMPERATURE_MODULE_H
@@ -0,0 +1,6 @@
+#include "runtime.h"
+#include "text-module.h"
+#include "opcodes.h"
+ELIOT_BEGIN
+#include "text.tbl"
+ELIOT_END
@@ -0,0 +1,8 @@
+#ifndef TEXT_MODULE_H
+#define TEXT_MODULE_H
+#define TBL_HEADER
+#include "opcodes.h"
+ELIOT_BEGIN
+#include "text.tbl"
+ELIOT_END
+#endif // TEXT_MODULE_H
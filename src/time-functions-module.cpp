@@ -0,0 +1,6 @@
+#include "runtime.h"
+#include "time-functions-module.h"
+#include "opcodes.h"
+ELIOT_BEGIN
+#include "time-functions.tbl"
+ELIOT_END
@@ -0,0 +1,9 @@
+#ifndef TIME_FUNCTIONS_MODULE_H
+#define TIME_FUNCTIONS_MODULE_H
+#define TBL_HEADER
+#include "opcodes.h"
+#include "time-functions.h"
+ELIOT_BEGIN
+#include "time-functions.tbl"
+ELIOT_END
+#endif // TIME_FUNCTIONS_MODULE_H
@@ -224,6 +224,7 @@ template <CopyMode mode> struct TreeCopyTemplate
         if (Text *tt = dest->AsText())
         {
             tt->value = what->value;
+            tt->hash = what->hash;
             tt->tag = ((what->Position()<<Tree::KINDBITS) | tt->Kind());
             return what;
         }
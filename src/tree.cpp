@@ -115,16 +115,16 @@ int Tree::Compare(Tree *left, Tree *right, bool recurse)
     {
         Name *ln = (Name *) left;
         Name *rn = (Name *) right;
+        if (ln->value == rn->value)
+            return 0;
         return ln->value < rn->value ? -1 : ln->value > rn->value ? 1 : 0;
     }
     case INFIX:
     {
         Infix *li = (Infix *) left;
         Infix *ri = (Infix *) right;
-        if (li->name < ri->name)
-            return -2;
-        else if (li->name > ri->name)
-            return 2;
+        if (li->name != ri->name)
+            return li->name < ri->name ? -2 : 2;
         if (recurse)
         {
             if (int cmpLeft = Compare(li->left, ri->left))
@@ -187,7 +187,7 @@ void Tree::SetPosition(TreePosition pos, bool recurse)
     do
     {
         ulong kind = tree->Kind();
-        tree->tag = (pos << KINDBITS) | kind;
+        tree->tag = (pos << KINDBITS) | kind | (tree->tag & CLOSURE);
         if (recurse)
         {
             switch(kind)
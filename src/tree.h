@@ -27,6 +27,7 @@
 #include "base.h"
 #include "gc.h"
 #include "info.h"
+#include "symbol.h"
 #include <map>
 
 #include <vector>
@@ -111,7 +112,7 @@ struct Tree
 //   The base class for all ELIOT trees
 // ----------------------------------------------------------------------------
 {
-    enum { KINDBITS = 3, KINDMASK=7 };
+    enum { KINDBITS = 4, KINDMASK=7, CLOSURE=8 };  // CLOSURE: see Closure
     enum { UNKNOWN_POSITION = ~0UL, COMMAND_LINE=~1UL, BUILTIN=~2UL };
     typedef Tree        self_t;
     typedef Tree *      value_t;
@@ -120,7 +121,7 @@ struct Tree
     Tree (kind k, TreePosition pos = NOWHERE):
         tag((pos<<KINDBITS) | k), info(NULL) {}
     Tree(kind k, Tree *from):
-        tag(from->tag), info(NULL)
+        tag(from->tag & ~CLOSURE), info(NULL)
     {
         assert(k == Kind()); (void) k;
     }
@@ -236,14 +237,18 @@ struct Text : Tree
     typedef text value_t;
     
     Text(value_t t, text open="\"", text close="\"", TreePosition pos=NOWHERE):
-        Tree(TEXT, pos), value(t), opening(open), closing(close) {}
+        Tree(TEXT, pos), value(t), opening(open), closing(close),
+        hash(TextHash(t)) {}
     Text(value_t t, TreePosition pos):
-        Tree(TEXT, pos), value(t), opening(textQuote), closing(textQuote) {}
+        Tree(TEXT, pos), value(t), opening(textQuote), closing(textQuote),
+        hash(TextHash(t)) {}
     Text(Text *t):
         Tree(TEXT, t),
-        value(t->value), opening(t->opening), closing(t->closing) {}
+        value(t->value), opening(t->opening), closing(t->closing),
+        hash(t->hash) {}
     value_t             value;
     text                opening, closing;
+    ulong               hash;           // TextHash(value), update with value
     static text         textQuote, charQuote;
     operator value_t()  { return value; }
     bool IsCharacter()
@@ -268,7 +273,7 @@ struct Name : Tree
     typedef Name self_t;
     typedef text value_t;
     
-    Name(value_t n, TreePosition pos = NOWHERE):
+    Name(Symbol n, TreePosition pos = NOWHERE):
         Tree(NAME, pos), value(n) {}
     Name(Name *n):
         Tree(NAME, n), value(n->value) {}
@@ -276,7 +281,7 @@ struct Name : Tree
     bool        IsOperator()    { return !IsEmpty() && !isalpha(value[0]); }
     bool        IsName()        { return !IsEmpty() && isalpha(value[0]); }
     bool        IsBoolean()     { return value=="true" || value=="false"; }
-    value_t     value;
+    Symbol      value;
     operator    value_t()       { return value; }
     GARBAGE_COLLECT(Name);
 };
@@ -362,14 +367,14 @@ struct Infix : Tree
     typedef Infix       self_t;
     typedef Infix *     value_t;
 
-    Infix(text n, Tree *l, Tree *r, TreePosition pos = NOWHERE):
+    Infix(Symbol n, Tree *l, Tree *r, TreePosition pos = NOWHERE):
         Tree(INFIX, pos), left(l), right(r), name(n) {}
     Infix(Infix *i, Tree *l, Tree *r):
         Tree(INFIX, i), left(l), right(r), name(i->name) {}
-    bool                IsDeclaration() { return name == "->"; }
+    bool                IsDeclaration() { return name == symArrow; }
     Tree_p              left;
     Tree_p              right;
-    text                name;
+    Symbol              name;
     GARBAGE_COLLECT(Infix);
 };
 